@@ -0,0 +1,155 @@
+// Benchmark for the rope.
+//
+// Each operation is timed on documents of a few sizes, and reported as one tab
+// separated line per measurement:
+//   node_size  bias  doc_bytes  op  ops  ns_per_op
+//
+// make bench builds and runs this with several ROPE_NODE_STR_SIZE and ROPE_BIAS
+// settings.
+
+#include "rope.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The number of edits timed per document.
+#define EDITS 10000
+
+// The number of seeks timed per document.
+#define SEEKS 100000
+
+// Copies and writes are repeated until about this many bytes have been processed.
+#define COPY_BYTES (64 * 1024 * 1024)
+
+static const size_t doc_sizes[] = {256 * 1024, 4 * 1024 * 1024, 32 * 1024 * 1024};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A fixed seed keeps runs comparable with each other.
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static size_t rng(size_t n)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state % n;
+}
+
+static void report(size_t doc_bytes, const char *op, size_t ops, double secs)
+{
+	printf("%d\t%d\t%zu\t%s\t%zu\t%.1f\n", ROPE_NODE_STR_SIZE, ROPE_BIAS, doc_bytes, op, ops, secs * 1e9 / ops);
+}
+
+// Make a document of num_bytes bytes of text, made up of lines of varying length.
+static uint8_t *make_text(size_t num_bytes)
+{
+	static const char words[] = "the quick brown fox jumps over the lazy dog ";
+
+	uint8_t *text = malloc(num_bytes);
+	if (text == NULL) {
+		return NULL;
+	}
+
+	size_t line_len = 0;
+	for (size_t i = 0; i < num_bytes; i++) {
+		if (line_len > 20 && rng(40) == 0) {
+			text[i]	 = '\n';
+			line_len = 0;
+		}
+		else {
+			text[i] = words[i % (sizeof(words) - 1)];
+			line_len++;
+		}
+	}
+	return text;
+}
+
+static void bench_doc(size_t doc_bytes)
+{
+	uint8_t *text = make_text(doc_bytes);
+	if (text == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	double start = now();
+	rope  *r     = rope_new_from_buffer(text, doc_bytes);
+	report(doc_bytes, "load", 1, now() - start);
+
+	rope *edited = rope_copy(r);
+	start	     = now();
+	for (int i = 0; i < EDITS; i++) {
+		rope_insert_n(edited, rng(rope_char_count(edited) + 1), (const uint8_t *)"abc\n", 4);
+	}
+	report(doc_bytes, "insert", EDITS, now() - start);
+
+	start = now();
+	for (int i = 0; i < EDITS; i++) {
+		rope_del(edited, rng(rope_char_count(edited)), 4);
+	}
+	report(doc_bytes, "delete", EDITS, now() - start);
+	rope_free(edited);
+
+	edited = rope_copy(r);
+	start  = now();
+	for (int i = 0; i < EDITS; i++) {
+		rope_insert_n(edited, rope_char_count(edited), (const uint8_t *)"abc\n", 4);
+	}
+	report(doc_bytes, "append", EDITS, now() - start);
+	rope_free(edited);
+
+	size_t sink = 0;
+	start	    = now();
+	for (int i = 0; i < SEEKS; i++) {
+		size_t byte_offset;
+		sink += rope_node_num_bytes(rope_node_at(r, rng(rope_char_count(r) + 1), &byte_offset)) + byte_offset;
+	}
+	report(doc_bytes, "seek", SEEKS, now() - start);
+
+	start = now();
+	for (int i = 0; i < SEEKS; i++) {
+		sink += rope_line_to_char(r, rng(rope_line_count(r)));
+	}
+	report(doc_bytes, "seek_line", SEEKS, now() - start);
+
+	size_t copies = COPY_BYTES / doc_bytes;
+	start	      = now();
+	for (size_t i = 0; i < copies; i++) {
+		rope_free(rope_copy(r));
+	}
+	report(doc_bytes, "copy", copies, now() - start);
+
+	uint8_t *dest = malloc(rope_byte_count(r) + 1);
+	if (dest == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	start = now();
+	for (size_t i = 0; i < copies; i++) {
+		sink += rope_write_cstr(r, dest);
+	}
+	report(doc_bytes, "write_cstr", copies, now() - start);
+
+	// Keep the compiler from dropping the lookups.
+	if (sink == 0) {
+		printf("\n");
+	}
+
+	free(dest);
+	rope_free(r);
+	free(text);
+}
+
+int main(void)
+{
+	printf("# node_size\tbias\tdoc_bytes\top\tops\tns_per_op\n");
+	for (size_t i = 0; i < sizeof(doc_sizes) / sizeof(doc_sizes[0]); i++) {
+		bench_doc(doc_sizes[i]);
+	}
+	return EXIT_SUCCESS;
+}
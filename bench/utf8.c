@@ -0,0 +1,137 @@
+// Benchmark for the utf8 scanning routines in utf8.c.
+//
+// Build it twice, with and without UTF8_SIMD, to compare the vector code with
+// the plain loops:
+//   make bench-utf8
+
+#include "utf8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUF_SIZE (16 * 1024 * 1024)
+#define ROUNDS 8
+
+// The size of the pieces the rope usually works on.
+#define NODE_SIZE 136
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill buf with lines made up of the given character, and return the number of
+// bytes used. Lines are cut short so they never end part way through a character.
+static size_t fill(uint8_t *buf, size_t size, const char *ch)
+{
+	size_t ch_len = strlen(ch);
+	size_t len    = 0;
+	int    col    = 0;
+	while (len + ch_len + 1 <= size) {
+		if (++col == 60) {
+			buf[len++] = '\n';
+			col	   = 0;
+		}
+		else {
+			memcpy(&buf[len], ch, ch_len);
+			len += ch_len;
+		}
+	}
+	return len;
+}
+
+// Split buf into node sized chunks which start and end on character boundaries.
+static size_t chunk_end(const uint8_t *buf, size_t start, size_t len)
+{
+	size_t end = start + NODE_SIZE < len ? start + NODE_SIZE : len;
+	while (end < len && (buf[end] & 0xc0) == 0x80) {
+		end--;
+	}
+	return end;
+}
+
+static void report(const char *input, const char *what, size_t bytes, double secs)
+{
+	printf("%s\t%s\t%.0f MB/s\n", input, what, bytes * (double)ROUNDS / secs / 1e6);
+}
+
+static void run(const char *input, const uint8_t *buf, size_t len)
+{
+	size_t chars, wchars, sink = 0;
+
+	double start = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		if (!utf8_check_and_count(buf, len, &chars, &wchars)) {
+			fprintf(stderr, "invalid utf8\n");
+			exit(EXIT_FAILURE);
+		}
+		sink += chars;
+	}
+	report(input, "check_and_count", len, now() - start);
+
+	start = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (size_t i = 0; i < len;) {
+			size_t end = chunk_end(buf, i, len);
+			utf8_check_and_count(&buf[i], end - i, &chars, &wchars);
+			sink += chars;
+			i = end;
+		}
+	}
+	report(input, "check_and_count/node", len, now() - start);
+
+	start = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		sink += utf8_count_chars(buf, len);
+	}
+	report(input, "count_chars", len, now() - start);
+
+	start = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (size_t i = 0; i < len;) {
+			size_t end = chunk_end(buf, i, len);
+			sink += utf8_count_chars(&buf[i], end - i);
+			i = end;
+		}
+	}
+	report(input, "count_chars/node", len, now() - start);
+
+	size_t total_chars = utf8_count_chars(buf, len);
+	start		   = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		sink += utf8_count_bytes(buf, total_chars);
+	}
+	report(input, "count_bytes", len, now() - start);
+
+	// The renderer looks for printable runs a line at a time.
+	start = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (size_t i = 0; i < len; i++) {
+			i += utf8_count_printable(&buf[i], len - i);
+			sink++;
+		}
+	}
+	report(input, "count_printable/line", len, now() - start);
+
+	if (sink == 0) {
+		printf("\n");
+	}
+}
+
+int main(void)
+{
+	uint8_t *buf = malloc(BUF_SIZE);
+	if (buf == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	printf("# utf8 %s\n", UTF8_SIMD ? "simd" : "scalar");
+	run("ascii", buf, fill(buf, BUF_SIZE, "x"));
+	run("cjk", buf, fill(buf, BUF_SIZE, "\xe6\x97\xa5"));
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,945 @@
+#include "re.h"
+#include "utf8.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How deeply groups may be nested.
+#define RE_MAX_DEPTH 64
+
+// The pattern is parsed into a tree of these.
+enum re_node_type {
+	RE_BYTES, // A byte in [lo, hi].
+	RE_EMPTY,
+	RE_CAT,
+	RE_ALT,
+	RE_STAR,
+	RE_PLUS,
+	RE_QUEST,
+	RE_BOL,
+	RE_EOL,
+};
+
+struct re_node {
+	enum re_node_type type;
+	uint8_t		  lo, hi;
+	int		  a, b;
+};
+
+struct re_parser {
+	const uint8_t *p;
+	const uint8_t *end;
+	int	       depth;
+	const char    *error;
+
+	struct re_node *nodes;
+	int		num_nodes;
+	int		nodes_size;
+};
+
+// The tree is then compiled to a Thompson NFA, whose states are these.
+enum nfa_state_type {
+	NFA_BYTES, // Go to out on a byte in [lo, hi].
+	NFA_SPLIT, // Go to both out and out1.
+	NFA_BOL,   // Go to out at the start of a line.
+	NFA_EOL,   // Go to out at the end of a line.
+	NFA_MATCH,
+};
+
+struct nfa_state {
+	uint8_t type;
+	uint8_t lo, hi;
+	int	out, out1;
+};
+
+struct nfa {
+	struct nfa_state *states;
+	int		  num_states;
+	int		  states_size;
+	int		  start;
+};
+
+// And finally the NFA is turned into a DFA. Each state's transitions are a row
+// of next, with a column per byte class. States are numbered by the offset of
+// their row, and the accepting states come first, so a state is accepting if
+// it's less than accept_limit.
+struct dfa {
+	uint32_t *next;
+	uint8_t	 *accept_eol; // Whether a match ends if the line ends here, by row.
+	uint32_t  accept_limit;
+	uint32_t  start[2];   // The start state in the middle, and at the start of a line.
+	uint32_t  dead;	      // Where the anchored DFA goes when nothing can match.
+};
+
+struct re {
+	uint8_t classes[256];
+	int	num_classes;
+
+	// Finds where the first match in a line ends.
+	struct dfa scan;
+
+	// Finds the longest match starting at a given position.
+	struct dfa match;
+};
+
+// ---- Parsing
+
+static int add_node(struct re_parser *ps, enum re_node_type type, int a, int b)
+{
+	if (ps->num_nodes == ps->nodes_size) {
+		int		size  = ps->nodes_size ? ps->nodes_size * 2 : 64;
+		struct re_node *nodes = realloc(ps->nodes, size * sizeof(struct re_node));
+		if (nodes == NULL) {
+			ps->error = "out of memory";
+			return -1;
+		}
+		ps->nodes      = nodes;
+		ps->nodes_size = size;
+	}
+	struct re_node *n = &ps->nodes[ps->num_nodes];
+	n->type		  = type;
+	n->lo = n->hi = 0;
+	n->a	      = a;
+	n->b	      = b;
+	return ps->num_nodes++;
+}
+
+static int add_bytes(struct re_parser *ps, uint8_t lo, uint8_t hi)
+{
+	int node = add_node(ps, RE_BYTES, 0, 0);
+	if (node != -1) {
+		ps->nodes[node].lo = lo;
+		ps->nodes[node].hi = hi;
+	}
+	return node;
+}
+
+// Join two nodes with cat or alt, where either may be missing (-1).
+static int add_pair(struct re_parser *ps, enum re_node_type type, int a, int b)
+{
+	if (a == -1 || b == -1) {
+		return a == -1 ? b : a;
+	}
+	return add_node(ps, type, a, b);
+}
+
+// Add the bytes of a character, one after another.
+static int add_sequence(struct re_parser *ps, const uint8_t *bytes, int len)
+{
+	int node = -1;
+	for (int i = 0; i < len && (i == 0 || node != -1); i++) {
+		node = add_pair(ps, RE_CAT, node, add_bytes(ps, bytes[i], bytes[i]));
+	}
+	return node;
+}
+
+// Match any character which takes up more than one byte.
+static int add_multibyte(struct re_parser *ps)
+{
+	int node = -1;
+	for (int len = 2; len <= 6; len++) {
+		uint8_t lo  = 0xff << (8 - len);
+		uint8_t hi  = len == 6 ? 0xfd : (uint8_t)(0xff << (7 - len)) - 1;
+		int	seq = add_bytes(ps, lo, hi);
+		for (int i = 1; i < len && seq != -1; i++) {
+			seq = add_pair(ps, RE_CAT, seq, add_bytes(ps, 0x80, 0xbf));
+		}
+		if (seq == -1) {
+			return -1;
+		}
+		node = add_pair(ps, RE_ALT, node, seq);
+	}
+	return node;
+}
+
+// Match one of a set of ASCII characters, as an alternation of runs. Newlines
+// are never matched. Returns -1 without an error if the set is empty.
+static int add_ascii_set(struct re_parser *ps, const bool set[128])
+{
+	int node = -1;
+	for (int c = 0; c < 128; c++) {
+		if (!set[c] || c == '\n') {
+			continue;
+		}
+		int lo = c;
+		while (c + 1 < 128 && set[c + 1] && c + 1 != '\n') {
+			c++;
+		}
+		int run = add_bytes(ps, lo, c);
+		if (run == -1) {
+			return -1;
+		}
+		node = add_pair(ps, RE_ALT, node, run);
+	}
+	return node;
+}
+
+// Read a character from the pattern. Returns its length, or 0 if it isn't valid utf8.
+static int read_char(struct re_parser *ps, uint8_t *buf)
+{
+	size_t len = utf8_codepoint_size(*ps->p);
+	if (len == SIZE_MAX || len > (size_t)(ps->end - ps->p)) {
+		ps->error = "invalid utf8";
+		return 0;
+	}
+	for (size_t i = 1; i < len; i++) {
+		if ((ps->p[i] & 0xc0) != 0x80) {
+			ps->error = "invalid utf8";
+			return 0;
+		}
+	}
+	memcpy(buf, ps->p, len);
+	ps->p += len;
+	return len;
+}
+
+// If c names a class like \d, add its ASCII characters to set and return true.
+// *multibyte is set if it includes every character outside ASCII.
+static bool escape_class(uint8_t c, bool set[128], bool *multibyte)
+{
+	bool in[128] = {0};
+	switch (c | 0x20) {
+	case 'd':
+		memset(&in['0'], 1, 10);
+		break;
+	case 'w':
+		memset(&in['0'], 1, 10);
+		memset(&in['a'], 1, 26);
+		memset(&in['A'], 1, 26);
+		in['_'] = true;
+		break;
+	case 's':
+		in[' '] = in['\t'] = in['\r'] = in['\f'] = in['\v'] = true;
+		break;
+	default:
+		return false;
+	}
+
+	// The upper case version is everything else.
+	bool negate = c >= 'A' && c <= 'Z';
+	for (int i = 0; i < 128; i++) {
+		set[i] |= in[i] != negate;
+	}
+	*multibyte |= negate;
+	return true;
+}
+
+static int parse_alt(struct re_parser *ps);
+
+static int parse_class(struct re_parser *ps)
+{
+	bool set[128]  = {0};
+	bool multibyte = false;
+	int  node      = -1;
+
+	bool negate = ps->p < ps->end && *ps->p == '^';
+	if (negate) {
+		ps->p++;
+	}
+
+	for (bool first = true;; first = false) {
+		if (ps->p == ps->end) {
+			ps->error = "missing ]";
+			return -1;
+		}
+		if (*ps->p == ']' && !first) {
+			ps->p++;
+			break;
+		}
+
+		uint8_t lo[6];
+		int	lo_len;
+		if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+			ps->p++;
+			if (escape_class(*ps->p, set, &multibyte)) {
+				ps->p++;
+				continue;
+			}
+			if (*ps->p == 't') {
+				ps->p++;
+				lo[0]  = '\t';
+				lo_len = 1;
+			}
+			else if ((lo_len = read_char(ps, lo)) == 0) {
+				return -1;
+			}
+		}
+		else if ((lo_len = read_char(ps, lo)) == 0) {
+			return -1;
+		}
+
+		if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+			ps->p++;
+			uint8_t hi[6];
+			if (read_char(ps, hi) != 1 || lo_len != 1) {
+				ps->error = ps->error ? ps->error : "ranges must be ASCII";
+				return -1;
+			}
+			if (lo[0] > hi[0]) {
+				ps->error = "invalid range";
+				return -1;
+			}
+			memset(&set[lo[0]], 1, hi[0] - lo[0] + 1);
+		}
+		else if (lo_len == 1) {
+			set[lo[0]] = true;
+		}
+		else if (negate) {
+			ps->error = "[^...] must only list ASCII characters";
+			return -1;
+		}
+		else {
+			int seq = add_sequence(ps, lo, lo_len);
+			if (seq == -1) {
+				return -1;
+			}
+			node = add_pair(ps, RE_ALT, node, seq);
+		}
+	}
+
+	if (negate) {
+		for (int i = 0; i < 128; i++) {
+			set[i] = !set[i];
+		}
+		multibyte = !multibyte;
+	}
+	if (multibyte) {
+		int any = add_multibyte(ps);
+		if (any == -1) {
+			return -1;
+		}
+		node = add_pair(ps, RE_ALT, node, any);
+	}
+	int ascii = add_ascii_set(ps, set);
+	if (ps->error) {
+		return -1;
+	}
+	node = add_pair(ps, RE_ALT, node, ascii);
+	if (node == -1) {
+		ps->error = "[...] matches nothing";
+	}
+	return node;
+}
+
+static int parse_atom(struct re_parser *ps)
+{
+	uint8_t buf[6];
+	int	len;
+	bool	set[128]  = {0};
+	bool	multibyte = false;
+
+	switch (*ps->p) {
+	case '(': {
+		ps->p++;
+		if (++ps->depth > RE_MAX_DEPTH) {
+			ps->error = "groups nested too deeply";
+			return -1;
+		}
+		int node = parse_alt(ps);
+		ps->depth--;
+		if (node != -1 && (ps->p == ps->end || *ps->p++ != ')')) {
+			ps->error = "missing )";
+			return -1;
+		}
+		return node;
+	}
+	case '*':
+	case '+':
+	case '?':
+		ps->error = "nothing to repeat";
+		return -1;
+	case '.': {
+		ps->p++;
+		memset(set, 1, sizeof(set));
+		int ascii = add_ascii_set(ps, set);
+		return ascii == -1 ? -1 : add_pair(ps, RE_ALT, ascii, add_multibyte(ps));
+	}
+	case '^':
+		ps->p++;
+		return add_node(ps, RE_BOL, 0, 0);
+	case '$':
+		ps->p++;
+		return add_node(ps, RE_EOL, 0, 0);
+	case '[':
+		ps->p++;
+		return parse_class(ps);
+	case '\\':
+		ps->p++;
+		if (ps->p == ps->end) {
+			ps->error = "trailing \\";
+			return -1;
+		}
+		if (escape_class(*ps->p, set, &multibyte)) {
+			ps->p++;
+			int ascii = add_ascii_set(ps, set);
+			return multibyte ? add_pair(ps, RE_ALT, ascii, add_multibyte(ps)) : ascii;
+		}
+		if (*ps->p == 't') {
+			ps->p++;
+			return add_bytes(ps, '\t', '\t');
+		}
+		break;
+	}
+
+	if ((len = read_char(ps, buf)) == 0) {
+		return -1;
+	}
+	return add_sequence(ps, buf, len);
+}
+
+static int parse_repeat(struct re_parser *ps)
+{
+	int node = parse_atom(ps);
+	while (node != -1 && ps->p < ps->end && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+		enum re_node_type type = *ps->p == '*' ? RE_STAR : *ps->p == '+' ? RE_PLUS : RE_QUEST;
+		ps->p++;
+		node = add_node(ps, type, node, 0);
+	}
+	return node;
+}
+
+static int parse_concat(struct re_parser *ps)
+{
+	int node = add_node(ps, RE_EMPTY, 0, 0);
+	while (node != -1 && ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+		int next = parse_repeat(ps);
+		node	 = next == -1 ? -1 : add_node(ps, RE_CAT, node, next);
+	}
+	return node;
+}
+
+static int parse_alt(struct re_parser *ps)
+{
+	int node = parse_concat(ps);
+	while (node != -1 && ps->p < ps->end && *ps->p == '|') {
+		ps->p++;
+		int next = parse_concat(ps);
+		node	 = next == -1 ? -1 : add_node(ps, RE_ALT, node, next);
+	}
+	return node;
+}
+
+// ---- NFA construction
+
+static int nfa_add(struct nfa *nfa, uint8_t type, uint8_t lo, uint8_t hi, int out, int out1)
+{
+	if (nfa->num_states == nfa->states_size) {
+		int		  size	 = nfa->states_size ? nfa->states_size * 2 : 64;
+		struct nfa_state *states = realloc(nfa->states, size * sizeof(struct nfa_state));
+		if (states == NULL) {
+			return -1;
+		}
+		nfa->states	 = states;
+		nfa->states_size = size;
+	}
+	struct nfa_state *s = &nfa->states[nfa->num_states];
+	s->type		    = type;
+	s->lo		    = lo;
+	s->hi		    = hi;
+	s->out		    = out;
+	s->out1		    = out1;
+	return nfa->num_states++;
+}
+
+// Compile a node so that it carries on to the state next. Returns the state
+// it starts at, or -1 if we ran out of memory.
+static int nfa_compile(struct nfa *nfa, const struct re_node *nodes, int node, int next)
+{
+	const struct re_node *n = &nodes[node];
+	int		      a, b, s;
+
+	switch (n->type) {
+	case RE_BYTES:
+		return nfa_add(nfa, NFA_BYTES, n->lo, n->hi, next, -1);
+	case RE_EMPTY:
+		return next;
+	case RE_CAT:
+		b = nfa_compile(nfa, nodes, n->b, next);
+		return b == -1 ? -1 : nfa_compile(nfa, nodes, n->a, b);
+	case RE_ALT:
+		a = nfa_compile(nfa, nodes, n->a, next);
+		b = a == -1 ? -1 : nfa_compile(nfa, nodes, n->b, next);
+		return b == -1 ? -1 : nfa_add(nfa, NFA_SPLIT, 0, 0, a, b);
+	case RE_STAR:
+	case RE_PLUS:
+		// The split loops back to the node, or carries on.
+		s = nfa_add(nfa, NFA_SPLIT, 0, 0, -1, next);
+		a = s == -1 ? -1 : nfa_compile(nfa, nodes, n->a, s);
+		if (a == -1) {
+			return -1;
+		}
+		nfa->states[s].out = a;
+		return n->type == RE_STAR ? s : a;
+	case RE_QUEST:
+		a = nfa_compile(nfa, nodes, n->a, next);
+		return a == -1 ? -1 : nfa_add(nfa, NFA_SPLIT, 0, 0, a, next);
+	case RE_BOL:
+		return nfa_add(nfa, NFA_BOL, 0, 0, next, -1);
+	case RE_EOL:
+		return nfa_add(nfa, NFA_EOL, 0, 0, next, -1);
+	}
+	return -1;
+}
+
+// ---- DFA construction
+
+// Each DFA state stands for a set of NFA states. Only the states which consume
+// bytes, match or wait for the end of a line are kept in the sets.
+struct dfa_builder {
+	const struct nfa *nfa;
+	const re	 *re;
+	bool		  unanchored;
+
+	// The sets of the DFA states so far, one after another.
+	int    *sets;
+	size_t	sets_len, sets_size;
+	size_t *set_ofs;
+	int    *set_len;
+	int	num_states, states_size;
+
+	// Open addressed, from a set's hash to its state + 1.
+	int   *table;
+	size_t table_size;
+
+	// The set being built, and marks for the NFA states already in it.
+	int	 *work;
+	int	  work_len;
+	int	 *stack;
+	uint32_t *marks;
+	uint32_t  mark;
+
+	// Transitions, by state and byte class.
+	uint32_t *next;
+	bool	 *accept;
+	bool	 *accept_eol;
+};
+
+// Add the NFA state s, and everything it leads to without consuming a byte,
+// to the work set.
+static void closure(struct dfa_builder *b, int s, bool bol)
+{
+	const struct nfa_state *states = b->nfa->states;
+	int			depth  = 0;
+	b->stack[depth++]	       = s;
+
+	while (depth > 0) {
+		s = b->stack[--depth];
+		if (b->marks[s] == b->mark) {
+			continue;
+		}
+		b->marks[s] = b->mark;
+
+		switch (states[s].type) {
+		case NFA_SPLIT:
+			b->stack[depth++] = states[s].out1;
+			b->stack[depth++] = states[s].out;
+			break;
+		case NFA_BOL:
+			if (bol) {
+				b->stack[depth++] = states[s].out;
+			}
+			break;
+		default:
+			b->work[b->work_len++] = s;
+			break;
+		}
+	}
+}
+
+// Whether a match ends if the line ends while in NFA state s. bol is whether
+// that's also the start of the line.
+static bool matches_at_eol(struct dfa_builder *b, int s, bool bol)
+{
+	const struct nfa_state *states = b->nfa->states;
+	int			depth  = 0;
+	b->mark++;
+	b->stack[depth++] = s;
+
+	while (depth > 0) {
+		s = b->stack[--depth];
+		if (b->marks[s] == b->mark) {
+			continue;
+		}
+		b->marks[s] = b->mark;
+
+		switch (states[s].type) {
+		case NFA_MATCH:
+			return true;
+		case NFA_SPLIT:
+			b->stack[depth++] = states[s].out1;
+			b->stack[depth++] = states[s].out;
+			break;
+		case NFA_BOL:
+			if (bol) {
+				b->stack[depth++] = states[s].out;
+			}
+			break;
+		case NFA_EOL:
+			b->stack[depth++] = states[s].out;
+			break;
+		}
+	}
+	return false;
+}
+
+static int compare_int(const void *a, const void *b) { return *(const int *)a - *(const int *)b; }
+
+static uint64_t hash_set(const int *set, int len)
+{
+	uint64_t h = 14695981039346656037u;
+	for (int i = 0; i < len; i++) {
+		h = (h ^ (uint32_t)set[i]) * 1099511628211u;
+	}
+	return h;
+}
+
+// Get the DFA state for the work set, adding it if it's new. Returns -1 if
+// there are too many states or we ran out of memory.
+static int add_state(struct dfa_builder *b)
+{
+	qsort(b->work, b->work_len, sizeof(int), compare_int);
+
+	size_t mask = b->table_size - 1;
+	size_t i    = hash_set(b->work, b->work_len) & mask;
+	for (; b->table[i] != 0; i = (i + 1) & mask) {
+		int s = b->table[i] - 1;
+		if (b->set_len[s] == b->work_len &&
+		    memcmp(&b->sets[b->set_ofs[s]], b->work, b->work_len * sizeof(int)) == 0) {
+			return s;
+		}
+	}
+
+	if (b->num_states == RE_MAX_STATES) {
+		return -1;
+	}
+	if (b->num_states == b->states_size) {
+		int	new_size = b->states_size * 2;
+		size_t *set_ofs	 = realloc(b->set_ofs, new_size * sizeof(size_t));
+		if (set_ofs != NULL) {
+			b->set_ofs = set_ofs;
+		}
+		int *set_len = realloc(b->set_len, new_size * sizeof(int));
+		if (set_len != NULL) {
+			b->set_len = set_len;
+		}
+		if (set_ofs == NULL || set_len == NULL) {
+			return -1;
+		}
+		b->states_size = new_size;
+	}
+	if (b->sets_len + b->work_len > b->sets_size) {
+		size_t new_size = (b->sets_size + b->work_len) * 2;
+		int   *sets	= realloc(b->sets, new_size * sizeof(int));
+		if (sets == NULL) {
+			return -1;
+		}
+		b->sets	     = sets;
+		b->sets_size = new_size;
+	}
+
+	int s	      = b->num_states++;
+	b->set_ofs[s] = b->sets_len;
+	b->set_len[s] = b->work_len;
+	memcpy(&b->sets[b->sets_len], b->work, b->work_len * sizeof(int));
+	b->sets_len += b->work_len;
+	b->table[i] = s + 1;
+	return s;
+}
+
+// Start a new work set, containing the NFA's start state if the DFA is
+// unanchored (so a match can start anywhere).
+static void begin_set(struct dfa_builder *b, bool with_start, bool bol)
+{
+	b->work_len = 0;
+	b->mark++;
+	if (with_start) {
+		closure(b, b->nfa->start, bol);
+	}
+}
+
+// Build the DFA. State 0 is the dead state for an anchored DFA, and for an
+// unanchored one it's where a match at the end of a line goes.
+static bool dfa_build(struct dfa *dfa, const re *re, const struct nfa *nfa, bool unanchored)
+{
+	struct dfa_builder b = {
+		.nfa	     = nfa,
+		.re	     = re,
+		.unanchored  = unanchored,
+		.states_size = 64,
+		.table_size  = 2 * RE_MAX_STATES,
+	};
+	bool ok = false;
+
+	b.sets_size = 64;
+	b.sets	    = malloc(b.sets_size * sizeof(int));
+	b.set_ofs   = malloc(b.states_size * sizeof(size_t));
+	b.set_len = malloc(b.states_size * sizeof(int));
+	b.table	  = calloc(b.table_size, sizeof(int));
+	b.work	  = malloc((nfa->num_states + 1) * sizeof(int));
+	b.stack	  = malloc(2 * nfa->num_states * sizeof(int) + sizeof(int));
+	b.marks	  = calloc(nfa->num_states, sizeof(uint32_t));
+
+	size_t row = re->num_classes;
+	b.next	   = malloc(RE_MAX_STATES * row * sizeof(uint32_t));
+	b.accept   = calloc(RE_MAX_STATES, sizeof(bool));
+	b.accept_eol = calloc(RE_MAX_STATES, sizeof(bool));
+	if (!b.sets || !b.set_ofs || !b.set_len || !b.table || !b.work || !b.stack || !b.marks || !b.next || !b.accept ||
+	    !b.accept_eol) {
+		goto out;
+	}
+
+	// The dead state has an empty set. The state for a match at the end of a
+	// line isn't looked up by its set, as an unanchored DFA can have an empty
+	// set too (after ^a, say), and it doesn't matter where it goes - the scan
+	// stops there.
+	begin_set(&b, false, false);
+	add_state(&b);
+	if (unanchored) {
+		memset(b.table, 0, b.table_size * sizeof(int));
+	}
+	uint32_t start[2];
+	// The state at the start of a line is told apart by a member past the end
+	// of the NFA, as a match may end there when it wouldn't elsewhere ($^).
+	int bol_mark = nfa->num_states;
+	for (int bol = 0; bol < 2; bol++) {
+		begin_set(&b, true, bol);
+		if (bol) {
+			b.work[b.work_len++] = bol_mark;
+		}
+		int s = add_state(&b);
+		if (s == -1) {
+			goto out;
+		}
+		start[bol] = s;
+	}
+	b.accept[0] = unanchored;
+
+	// Find every state's transitions, adding new states to the end as they
+	// turn up.
+	uint8_t reps[256];
+	for (int c = 255; c >= 0; c--) {
+		reps[re->classes[c]] = c;
+	}
+	for (int s = 1; s < b.num_states; s++) {
+		// The mark sorts last.
+		int  len = b.set_len[s];
+		bool bol = len > 0 && b.sets[b.set_ofs[s] + len - 1] == bol_mark;
+		len -= bol;
+		for (int i = 0; i < len; i++) {
+			const struct nfa_state *ns = &nfa->states[b.sets[b.set_ofs[s] + i]];
+			b.accept[s] |= ns->type == NFA_MATCH;
+			b.accept_eol[s] |= ns->type == NFA_MATCH || (ns->type == NFA_EOL && matches_at_eol(&b, ns->out, bol));
+		}
+
+		for (int c = 0; c < re->num_classes; c++) {
+			int next;
+			if (reps[c] == '\n') {
+				// Lines never contain a newline, so this is the end of the line.
+				next = unanchored && !b.accept_eol[s] ? (int)start[1] : 0;
+			}
+			else {
+				// The set may move, so copy it out before adding to it.
+				size_t ofs = b.set_ofs[s];
+				begin_set(&b, unanchored, false);
+				for (int i = 0; i < len; i++) {
+					const struct nfa_state *ns = &nfa->states[b.sets[ofs + i]];
+					if (ns->type == NFA_BYTES && ns->lo <= reps[c] && reps[c] <= ns->hi) {
+						closure(&b, ns->out, false);
+					}
+				}
+				next = add_state(&b);
+				if (next == -1) {
+					goto out;
+				}
+			}
+			b.next[s * row + c] = next;
+		}
+	}
+	for (size_t c = 0; c < row; c++) {
+		b.next[c] = 0;
+	}
+
+	// Renumber the states so the accepting ones come first, and by the
+	// offsets of their rows.
+	uint32_t *order = malloc(b.num_states * sizeof(uint32_t));
+	dfa->next	= malloc(b.num_states * row * sizeof(uint32_t));
+	dfa->accept_eol = malloc(b.num_states);
+	if (!order || !dfa->next || !dfa->accept_eol) {
+		free(order);
+		goto out;
+	}
+	uint32_t n = 0;
+	for (int pass = 1; pass >= 0; pass--) {
+		for (int s = 0; s < b.num_states; s++) {
+			if (b.accept[s] == pass) {
+				order[s] = n++;
+			}
+		}
+		if (pass == 1) {
+			dfa->accept_limit = n * row;
+		}
+	}
+	for (int s = 0; s < b.num_states; s++) {
+		for (size_t c = 0; c < row; c++) {
+			dfa->next[order[s] * row + c] = order[b.next[s * row + c]] * row;
+		}
+		dfa->accept_eol[order[s]] = b.accept_eol[s];
+	}
+	dfa->start[0] = order[start[0]] * row;
+	dfa->start[1] = order[start[1]] * row;
+	dfa->dead     = order[0] * row;
+	free(order);
+	ok = true;
+
+out:
+	free(b.sets);
+	free(b.set_ofs);
+	free(b.set_len);
+	free(b.table);
+	free(b.work);
+	free(b.stack);
+	free(b.marks);
+	free(b.next);
+	free(b.accept);
+	free(b.accept_eol);
+	return ok;
+}
+
+// Split the bytes into classes which every part of the NFA treats the same.
+// Newlines always get a class of their own.
+static void find_classes(re *re, const struct nfa *nfa)
+{
+	bool split[257] = {0};
+	split['\n']	= split['\n' + 1] = true;
+	for (int i = 0; i < nfa->num_states; i++) {
+		if (nfa->states[i].type == NFA_BYTES) {
+			split[nfa->states[i].lo]	 = true;
+			split[nfa->states[i].hi + 1] = true;
+		}
+	}
+
+	int class = 0;
+	for (int c = 0; c < 256; c++) {
+		if (split[c] && c > 0) {
+			class++;
+		}
+		re->classes[c] = class;
+	}
+	re->num_classes = class + 1;
+}
+
+re *re_compile(const char *pattern, size_t len, const char **error)
+{
+	struct re_parser ps = {
+		.p   = (const uint8_t *)pattern,
+		.end = (const uint8_t *)pattern + len,
+	};
+	struct nfa nfa = {0};
+	re	  *re  = calloc(1, sizeof(struct re));
+
+	int root = parse_alt(&ps);
+	if (root != -1 && ps.p < ps.end) {
+		ps.error = "unmatched )";
+	}
+	if (ps.error == NULL && re == NULL) {
+		ps.error = "out of memory";
+	}
+	if (ps.error == NULL) {
+		int match = nfa_add(&nfa, NFA_MATCH, 0, 0, -1, -1);
+		nfa.start = match == -1 ? -1 : nfa_compile(&nfa, ps.nodes, root, match);
+		if (nfa.start == -1) {
+			ps.error = "out of memory";
+		}
+	}
+	if (ps.error == NULL) {
+		find_classes(re, &nfa);
+		if (!dfa_build(&re->scan, re, &nfa, true) || !dfa_build(&re->match, re, &nfa, false)) {
+			ps.error = "pattern too complex";
+		}
+	}
+
+	free(ps.nodes);
+	free(nfa.states);
+	if (ps.error != NULL) {
+		*error = ps.error;
+		re_free(re);
+		return NULL;
+	}
+	return re;
+}
+
+void re_free(re *re)
+{
+	if (re != NULL) {
+		free(re->scan.next);
+		free(re->scan.accept_eol);
+		free(re->match.next);
+		free(re->match.accept_eol);
+		free(re);
+	}
+}
+
+// ---- Matching
+
+re_state re_scan_start(const re *re, bool bol) { return re->scan.start[bol]; }
+
+bool re_scan(const re *re, re_state *state, const uint8_t *str, size_t len, size_t *end)
+{
+	const uint32_t *next	     = re->scan.next;
+	const uint8_t  *classes	     = re->classes;
+	uint32_t	accept_limit = re->scan.accept_limit;
+	uint32_t	s	     = *state;
+
+	if (s < accept_limit) {
+		*end = 0;
+		return true;
+	}
+	for (size_t i = 0; i < len; i++) {
+		s = next[s + classes[str[i]]];
+		if (s < accept_limit) {
+			*state = s;
+			// State 0 is a match which ended at the newline, not after it.
+			*end = s == 0 ? i : i + 1;
+			return true;
+		}
+	}
+	*state = s;
+	return false;
+}
+
+bool re_scan_finish(const re *re, re_state state)
+{
+	return state < re->scan.accept_limit || re->scan.accept_eol[state / re->num_classes];
+}
+
+bool re_match(const re *re, const uint8_t *line, size_t len, size_t from, size_t *start, size_t *end)
+{
+	const struct dfa *dfa = &re->match;
+
+	for (size_t i = from; i <= len; i++) {
+		// Matches only start at the start of a character.
+		if (i < len && (line[i] & 0xc0) == 0x80) {
+			continue;
+		}
+
+		uint32_t s    = dfa->start[i == 0];
+		size_t	 last = s < dfa->accept_limit ? i : SIZE_MAX;
+		size_t	 j    = i;
+		for (; j < len && s != dfa->dead; j++) {
+			s = dfa->next[s + re->classes[line[j]]];
+			if (s < dfa->accept_limit) {
+				last = j + 1;
+			}
+		}
+		if (j == len && dfa->accept_eol[s / re->num_classes]) {
+			last = len;
+		}
+		if (last != SIZE_MAX) {
+			*start = i;
+			*end   = last;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,73 @@
+/* Regular expressions, matched a line at a time with a DFA.
+ *
+ * The syntax is a small part of POSIX extended regular expressions:
+ *
+ *   .            any character except a newline
+ *   [abc] [a-z]  one of a set of characters, or none of them with [^...]
+ *   \d \w \s     digits, word characters and spaces (\D \W \S for the rest)
+ *   ^ $          the start and end of a line
+ *   * + ?        repetition
+ *   a|b (...)    alternation and grouping
+ *   \c           the character c, for any other c. \t is a tab.
+ *
+ * Patterns and text are utf8. Ranges in [...] must be ASCII, but other
+ * characters may be listed one by one (except in [^...]).
+ *
+ * Matches never span lines, so a text can be split up at line starts and the
+ * pieces searched independently. Both DFAs are built up front and are read
+ * only afterwards, so one compiled expression can be used by several threads
+ * at once.
+ */
+
+#ifndef re_h
+#define re_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+// Patterns which need more DFA states than this are refused.
+#ifndef RE_MAX_STATES
+#define RE_MAX_STATES 4096
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct re re;
+
+// Where a scan has got to. This carries over from one piece of text to the next.
+typedef uint32_t re_state;
+
+// Compile the len bytes at pattern. Returns NULL and points *error at a
+// message if the pattern is invalid or too complex.
+re *re_compile(const char *pattern, size_t len, const char **error);
+
+void re_free(re *re);
+
+// Get the state to start scanning in. bol is whether the text starts at the
+// start of a line.
+re_state re_scan_start(const re *re, bool bol);
+
+// Scan the len bytes at str for the end of a match, carrying on from *state.
+// Returns true and sets *end to the offset just past the match which ends
+// first, or returns false once all of str has been scanned. After a match the
+// caller should carry on from the start of the next line with a new state.
+bool re_scan(const re *re, re_state *state, const uint8_t *str, size_t len, size_t *end);
+
+// Whether a match ends at the end of the text, once it has all been scanned.
+bool re_scan_finish(const re *re, re_state state);
+
+// Find the leftmost and then longest match in the len bytes of a single line
+// at line, which starts at or after from. Returns false if there's none.
+bool re_match(const re *re, const uint8_t *line, size_t len, size_t from, size_t *start, size_t *end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,25 +10,92 @@
 #endif
 
 #include "rope.h"
+#include "utf8.h"
 #include <assert.h>
 
-// The number of bytes the rope head structure takes up
-static const size_t ROPE_SIZE = sizeof(rope) + sizeof(rope_node) * ROPE_MAX_HEIGHT;
+// The number of bytes the rope head structure takes up. The head's data is
+// stored after room for the tallest possible nexts list.
+static const size_t ROPE_SIZE = sizeof(rope) + sizeof(rope_skip_node) * ROPE_MAX_HEIGHT + ROPE_NODE_STR_SIZE;
+
+// An external buffer referenced by nodes of one or more ropes.
+typedef struct rope_external_t {
+	// The number of ropes referring to the buffer.
+	size_t refs;
+
+	const uint8_t *buf;
+	size_t	       num_bytes;
+	void (*release)(const uint8_t *buf, size_t num_bytes, void *ctx);
+	void *ctx;
+} rope_external;
+
+// Storage for a node's data. A chunk is shared between a rope and its copies,
+// and is only written to while a single node refers to it.
+typedef struct rope_chunk_t {
+	// The number of nodes referring to the chunk, across all copies of the rope.
+	size_t refs;
+
+	// The next chunk on the pool's free list, while the chunk isn't in use.
+	struct rope_chunk_t *next;
+
+	uint8_t str[ROPE_NODE_STR_SIZE];
+} rope_chunk;
+
+// Chunk pool. Like the node pool, chunks are carved out of slabs and kept on a
+// free list, but the pool is shared by a rope and its copies since they share
+// chunks. The slabs are released when the last rope using the pool is freed.
+typedef struct rope_chunk_pool_t {
+	// The number of ropes using the pool.
+	size_t refs;
+
+	rope_chunk *free_chunks;
+	void	   *slabs;
+} rope_chunk_pool;
+
+// Get the storage the head has for its data, past room for the tallest nexts.
+static inline uint8_t *head_storage(const rope *r) { return (uint8_t *)&r->head.nexts[ROPE_MAX_HEIGHT]; }
+
+// Whether the node's data lives in an external buffer. External data is read
+// only - edits split the node up instead of writing to it.
+static inline bool node_is_external(const rope *r, const rope_node *n) { return n->chunk == NULL && n != &r->head; }
+
+// Drop this rope's reference to its external buffer.
+static void release_external(rope *r)
+{
+	rope_external *e = r->external;
+	if (e != NULL && --e->refs == 0) {
+		e->release(e->buf, e->num_bytes, e->ctx);
+		r->free(e);
+	}
+	r->external = NULL;
+}
 
 // Create a new rope with no contents
 rope *rope_new2(void *(*alloc)(size_t bytes), void *(*realloc)(void *ptr, size_t newsize), void (*free)(void *ptr))
 {
-	rope *r	     = (rope *)alloc(ROPE_SIZE);
+	rope		*r	= (rope *)alloc(ROPE_SIZE);
+	rope_chunk_pool *chunks = (rope_chunk_pool *)alloc(sizeof(rope_chunk_pool));
 	r->num_chars = r->num_bytes = 0;
 
 	r->alloc   = alloc;
 	r->realloc = realloc;
 	r->free	   = free;
 
-	r->head.height		   = 1;
-	r->head.num_bytes	   = 0;
-	r->head.nexts[0].node	   = NULL;
-	r->head.nexts[0].skip_size = 0;
+	memset(r->free_nodes, 0, sizeof(r->free_nodes));
+	r->slabs    = NULL;
+	r->external = NULL;
+
+	chunks->refs	    = 1;
+	chunks->free_chunks = NULL;
+	chunks->slabs	    = NULL;
+	r->chunks	    = chunks;
+
+	r->head.str		      = head_storage(r);
+	r->head.chunk		      = NULL;
+	r->head.height		      = 1;
+	r->head.num_bytes	      = 0;
+	r->head.nexts[0].node	      = NULL;
+	r->head.nexts[0].skip_size    = 0;
+	r->head.nexts[0].newline_size = 0;
 #if ROPE_WCHAR
 	r->head.nexts[0].wchar_size = 0;
 #endif
@@ -52,6 +119,8 @@ rope *rope_new_with_utf8(const uint8_t *str)
 	}
 }
 
+static rope_node *alloc_node(rope *r, uint8_t height);
+
 rope *rope_copy(const rope *other)
 {
 	rope *r = (rope *)other->alloc(ROPE_SIZE);
@@ -59,6 +128,19 @@ rope *rope_copy(const rope *other)
 	// Just copy most of the head's data. Note this won't copy the nexts list in head.
 	*r = *other;
 
+	// The copy gets a node pool of its own.
+	memset(r->free_nodes, 0, sizeof(r->free_nodes));
+	r->slabs = NULL;
+
+	r->head.str = head_storage(r);
+	memcpy(r->head.str, other->head.str, other->head.num_bytes);
+
+	// The nodes share their data with the other rope's nodes.
+	r->chunks->refs++;
+	if (r->external) {
+		r->external->refs++;
+	}
+
 	rope_node *nodes[ROPE_MAX_HEIGHT];
 
 	for (int i = 0; i < other->head.height; i++) {
@@ -68,14 +150,15 @@ rope *rope_copy(const rope *other)
 	}
 
 	for (rope_node *n = other->head.nexts[0].node; n != NULL; n = n->nexts[0].node) {
-		// I wonder if it would be faster if we took this opportunity to rebalance the node list..?
 		size_t	   h  = n->height;
-		rope_node *n2 = (rope_node *)r->alloc(sizeof(rope_node) + h * sizeof(rope_skip_node));
+		rope_node *n2 = alloc_node(r, h);
 
-		// Would it be faster to just *n2 = *n; ?
+		n2->str	      = n->str;
+		n2->chunk     = n->chunk;
 		n2->num_bytes = n->num_bytes;
-		n2->height    = h;
-		memcpy(n2->str, n->str, n->num_bytes);
+		if (n->chunk) {
+			n->chunk->refs++;
+		}
 		memcpy(n2->nexts, n->nexts, h * sizeof(rope_skip_node));
 
 		for (size_t i = 0; i < h; i++) {
@@ -87,17 +170,42 @@ rope *rope_copy(const rope *other)
 	return r;
 }
 
+static void release_chunk(rope *r, rope_chunk *c);
+
+// Free a list of slabs allocated by one of the pools.
+static void free_slabs(rope *r, void *slabs)
+{
+	void *next;
+	for (void *slab = slabs; slab != NULL; slab = next) {
+		next = *(void **)slab;
+		r->free(slab);
+	}
+}
+
 // Free the specified rope
 void rope_free(rope *r)
 {
 	assert(r);
-	rope_node *next;
 
-	for (rope_node *n = r->head.nexts[0].node; n != NULL; n = next) {
-		next = n->nexts[0].node;
-		r->free(n);
+	rope_chunk_pool *chunks = r->chunks;
+	if (--chunks->refs == 0) {
+		// No other rope can be using any of the chunks.
+		free_slabs(r, chunks->slabs);
+		r->free(chunks);
+	}
+	else {
+		// Copies of the rope may still share some of its chunks.
+		for (rope_node *n = r->head.nexts[0].node; n != NULL; n = n->nexts[0].node) {
+			if (n->chunk) {
+				release_chunk(r, n->chunk);
+			}
+		}
 	}
 
+	// Every node lives in one of the pool's slabs, so there's no need to walk the list.
+	free_slabs(r, r->slabs);
+
+	release_external(r);
 	r->free(r);
 }
 
@@ -116,6 +224,13 @@ size_t rope_byte_count(const rope *r)
 	return r->num_bytes;
 }
 
+// Get the number of lines in the rope.
+size_t rope_line_count(const rope *r)
+{
+	assert(r);
+	return r->head.nexts[r->head.height - 1].newline_size + 1;
+}
+
 // Copies the rope's contents into a utf8 encoded C string. Also copies a trailing '\0' character.
 // Returns the number of bytes written, which is rope_byte_count(r) + 1.
 size_t rope_write_cstr(rope *r, uint8_t *dest)
@@ -179,60 +294,123 @@ static uint8_t random_height()
 }
 
 // Figure out how many bytes to allocate for a node with the specified height.
-static size_t node_size(uint8_t height) { return sizeof(rope_node) + height * sizeof(rope_skip_node); }
+static size_t node_size(uint8_t height)
+{
+	return sizeof(rope_node) + height * sizeof(rope_skip_node);
+}
+
+// Each slab starts with a header linking it to the next slab. The header is
+// padded so the nodes which follow it are suitably aligned.
+typedef union {
+	void  *next;
+	double align;
+	size_t align2;
+} slab_header;
+
+// Allocate a slab for nodes of the specified height and put all of its nodes
+// on the free list.
+static bool alloc_slab(rope *r, uint8_t height)
+{
+	size_t size	 = node_size(height);
+	size_t num_nodes = MAX((ROPE_POOL_SLAB_SIZE - sizeof(slab_header)) / size, 1);
+
+	slab_header *slab = (slab_header *)r->alloc(sizeof(slab_header) + num_nodes * size);
+	if (slab == NULL) {
+		return false;
+	}
+	slab->next = r->slabs;
+	r->slabs   = slab;
+
+	uint8_t *p = (uint8_t *)(slab + 1);
+	for (size_t i = 0; i < num_nodes; i++, p += size) {
+		rope_node *node	      = (rope_node *)p;
+		node->height	      = height;
+		node->nexts[0].node   = r->free_nodes[height];
+		r->free_nodes[height] = node;
+	}
+	return true;
+}
 
 // Allocate and return a new node. The new node will be full of junk, except
-// for its height.
-// This function should be replaced at some point with an object pool based version.
+// for its height. Its str and chunk still need to be set up.
 static rope_node *alloc_node(rope *r, uint8_t height)
 {
-	rope_node *node = (rope_node *)r->alloc(node_size(height));
-	node->height	= height;
+	if (r->free_nodes[height] == NULL && !alloc_slab(r, height)) {
+		return NULL;
+	}
+	rope_node *node	      = r->free_nodes[height];
+	r->free_nodes[height] = node->nexts[0].node;
+	assert(node->height == height);
 	return node;
 }
 
-// Find out how many bytes the unicode character which starts with the specified byte
-// will occupy in memory.
-// Returns the number of bytes, or SIZE_MAX if the byte is invalid.
-static inline size_t codepoint_size(uint8_t byte)
-{
-	if (byte == 0) {
-		return SIZE_MAX;
-	} // NULL byte.
-	else if (byte <= 0x7f) {
-		return 1;
-	} // 0x74 = 0111 1111
-	else if (byte <= 0xbf) {
-		return SIZE_MAX;
-	} // 1011 1111. Invalid for a starting byte.
-	else if (byte <= 0xdf) {
-		return 2;
-	} // 1101 1111
-	else if (byte <= 0xef) {
-		return 3;
-	} // 1110 1111
-	else if (byte <= 0xf7) {
-		return 4;
-	} // 1111 0111
-	else if (byte <= 0xfb) {
-		return 5;
-	} // 1111 1011
-	else if (byte <= 0xfd) {
-		return 6;
-	} // 1111 1101
-	else {
-		return SIZE_MAX;
+// Allocate a slab of chunks and put them all on the pool's free list.
+static bool alloc_chunk_slab(rope *r)
+{
+	rope_chunk_pool *pool	    = r->chunks;
+	size_t		 num_chunks = MAX((ROPE_POOL_SLAB_SIZE - sizeof(slab_header)) / sizeof(rope_chunk), 1);
+
+	slab_header *slab = (slab_header *)r->alloc(sizeof(slab_header) + num_chunks * sizeof(rope_chunk));
+	if (slab == NULL) {
+		return false;
 	}
+	slab->next  = pool->slabs;
+	pool->slabs = slab;
+
+	rope_chunk *chunks = (rope_chunk *)(slab + 1);
+	for (size_t i = 0; i < num_chunks; i++) {
+		chunks[i].next	  = pool->free_chunks;
+		pool->free_chunks = &chunks[i];
+	}
+	return true;
 }
 
-// This little function counts how many bytes a certain number of characters take up.
-static size_t count_bytes_in_utf8(const uint8_t *str, size_t num_chars)
+// Give a node a chunk of its own to store its data in.
+static void alloc_chunk(rope *r, rope_node *node)
 {
-	const uint8_t *p = str;
-	for (unsigned int i = 0; i < num_chars; i++) {
-		p += codepoint_size(*p);
+	rope_chunk_pool *pool = r->chunks;
+	if (pool->free_chunks == NULL && !alloc_chunk_slab(r)) {
+		node->chunk = NULL;
+		node->str   = NULL;
+		return;
+	}
+	rope_chunk *c	  = pool->free_chunks;
+	pool->free_chunks = c->next;
+	c->refs		  = 1;
+	node->chunk	  = c;
+	node->str	  = c->str;
+}
+
+// Drop a node's reference to a chunk, returning it to the pool if it was the last.
+static void release_chunk(rope *r, rope_chunk *c)
+{
+	if (--c->refs == 0) {
+		c->next		       = r->chunks->free_chunks;
+		r->chunks->free_chunks = c;
+	}
+}
+
+// Get a node ready to have its data written to. If the node's chunk is shared
+// with a copy of the rope, the data is copied into a chunk of its own first.
+static void unshare_node(rope *r, rope_node *node)
+{
+	rope_chunk *c = node->chunk;
+	if (c == NULL || c->refs == 1) {
+		return;
 	}
-	return p - str;
+	alloc_chunk(r, node);
+	memcpy(node->str, c->str, node->num_bytes);
+	release_chunk(r, c);
+}
+
+// Put a node which is no longer in the list back into the pool.
+static void free_node(rope *r, rope_node *node)
+{
+	if (node->chunk) {
+		release_chunk(r, node->chunk);
+	}
+	node->nexts[0].node	    = r->free_nodes[node->height];
+	r->free_nodes[node->height] = node;
 }
 
 #if ROPE_WCHAR
@@ -244,7 +422,7 @@ static size_t count_wchars_in_utf8(const uint8_t *str, size_t num_chars)
 	size_t wchars = 0;
 	for (unsigned int i = 0; i < num_chars; i++) {
 		wchars += 1 + NEEDS_TWO_WCHARS(*str);
-		str += codepoint_size(*str);
+		str += utf8_codepoint_size(*str);
 	}
 	return wchars;
 }
@@ -257,50 +435,23 @@ static size_t count_utf8_in_wchars(const uint8_t *str, size_t num_wchars)
 			chars--;
 			i++;
 		}
-		str += codepoint_size(*str);
+		str += utf8_codepoint_size(*str);
 	}
 	return chars;
 }
 #endif
 
-// Count the number of characters in a string.
-static size_t strlen_utf8(const uint8_t *str)
-{
-	const uint8_t *p = str;
-	size_t	       i = 0;
-	while (*p) {
-		p += codepoint_size(*p);
-		i++;
-	}
-	return i;
-}
-
-// Checks if a UTF8 string is ok. Returns the number of bytes in the string if
-// it is ok, otherwise returns -1.
-static ssize_t bytelen_and_check_utf8(const uint8_t *str)
+// Count the number of newline characters in the first num_bytes bytes of a string.
+static size_t count_newlines(const uint8_t *str, size_t num_bytes)
 {
-	const uint8_t *p = str;
-	while (*p != '\0') {
-		size_t size = codepoint_size(*p);
-		if (size == SIZE_MAX)
-			return -1;
+	size_t	       newlines = 0;
+	const uint8_t *end	= str + num_bytes;
+	const uint8_t *p	= str;
+	while ((p = (const uint8_t *)memchr(p, '\n', end - p)) != NULL) {
+		newlines++;
 		p++;
-		size--;
-		while (size > 0) {
-			// Check that any middle bytes are of the form 0x10xx xxxx
-			if ((*p & 0xc0) != 0x80)
-				return -1;
-			p++;
-			size--;
-		}
 	}
-
-#ifdef DEBUG
-	size_t num = p - str;
-	assert(num == strlen((char *)str));
-#endif
-
-	return p - str;
+	return newlines;
 }
 
 typedef struct {
@@ -322,6 +473,7 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter)
 	// Offset stores how many characters we still need to skip in the current node.
 	size_t offset = char_pos;
 	size_t skip;
+	size_t newline_pos = 0; // Current newline count from the start of the rope.
 #if ROPE_WCHAR
 	size_t wchar_pos = 0; // Current wchar pos from the start of the rope.
 #endif
@@ -333,6 +485,7 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter)
 			assert(e == &r->head || e->num_bytes);
 
 			offset -= skip;
+			newline_pos += e->nexts[height].newline_size;
 #if ROPE_WCHAR
 			wchar_pos += e->nexts[height].wchar_size;
 #endif
@@ -340,8 +493,9 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter)
 		}
 		else {
 			// Go down.
-			iter->s[height].skip_size = offset;
-			iter->s[height].node	  = e;
+			iter->s[height].skip_size    = offset;
+			iter->s[height].node	     = e;
+			iter->s[height].newline_size = newline_pos;
 #if ROPE_WCHAR
 			iter->s[height].wchar_size = wchar_pos;
 #endif
@@ -355,6 +509,15 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter)
 		}
 	}
 
+	// The iterator has the newline count from the start of the whole string.
+	// Convert it into the number of newlines between each node and the position.
+	if (offset) {
+		newline_pos += count_newlines(e->str, utf8_count_bytes(e->str, offset));
+	}
+	for (int i = 0; i < r->head.height; i++) {
+		iter->s[i].newline_size = newline_pos - iter->s[i].newline_size;
+	}
+
 #if ROPE_WCHAR
 	// For some reason, this is _REALLY SLOW_. Like, 5.5Mops/s -> 4Mops/s from this block of code.
 	wchar_pos += count_wchars_in_utf8(e->str, offset);
@@ -365,7 +528,7 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter)
 	}
 #endif
 
-	assert(offset <= ROPE_NODE_STR_SIZE);
+	assert(offset <= e->nexts[0].skip_size);
 	assert(iter->s[0].node == e);
 	return e;
 }
@@ -382,7 +545,8 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
 	// Offset stores how many wchar characters we still need to skip in the current node.
 	size_t offset = wchar_pos;
 	size_t skip;
-	size_t char_pos = 0; // Current char pos from the start of the rope.
+	size_t char_pos	   = 0; // Current char pos from the start of the rope.
+	size_t newline_pos = 0; // Current newline count from the start of the rope.
 
 	while (true) {
 		skip = e->nexts[height].wchar_size;
@@ -390,13 +554,15 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
 			// Go right.
 			offset -= skip;
 			char_pos += e->nexts[height].skip_size;
+			newline_pos += e->nexts[height].newline_size;
 			e = e->nexts[height].node;
 		}
 		else {
 			// Go down.
-			iter->s[height].skip_size  = char_pos;
-			iter->s[height].node	   = e;
-			iter->s[height].wchar_size = offset;
+			iter->s[height].skip_size    = char_pos;
+			iter->s[height].node	     = e;
+			iter->s[height].wchar_size   = offset;
+			iter->s[height].newline_size = newline_pos;
 
 			if (height == 0) {
 				break;
@@ -407,11 +573,14 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
 		}
 	}
 
-	char_pos += count_utf8_in_wchars(e->str, offset);
+	size_t node_chars = count_utf8_in_wchars(e->str, offset);
+	char_pos += node_chars;
+	newline_pos += count_newlines(e->str, utf8_count_bytes(e->str, node_chars));
 
 	// The iterator has character positions from the start of the rope to the start of the node.
 	for (int i = 0; i < r->head.height; i++) {
-		iter->s[i].skip_size = char_pos - iter->s[i].skip_size;
+		iter->s[i].skip_size	= char_pos - iter->s[i].skip_size;
+		iter->s[i].newline_size = newline_pos - iter->s[i].newline_size;
 	}
 	assert(e == iter->s[0].node);
 	return e;
@@ -419,27 +588,32 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
 #endif
 
 #if ROPE_WCHAR
-static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars, size_t num_wchars)
+static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars, size_t num_newlines, size_t num_wchars)
 {
 	for (int i = 0; i < r->head.height; i++) {
 		iter->s[i].node->nexts[i].skip_size += num_chars;
+		iter->s[i].node->nexts[i].newline_size += num_newlines;
 		iter->s[i].node->nexts[i].wchar_size += num_wchars;
 	}
 }
 #else
-static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars)
+static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars, size_t num_newlines)
 {
 	for (int i = 0; i < r->head.height; i++) {
 		iter->s[i].node->nexts[i].skip_size += num_chars;
+		iter->s[i].node->nexts[i].newline_size += num_newlines;
 	}
 }
 #endif
 
 // Internal method of rope_insert.
 // This function creates a new node in the rope at the specified position and fills it with the
-// passed string.
-static void insert_at(rope *r, rope_iter *iter, const uint8_t *str, size_t num_bytes, size_t num_chars)
+// passed string. If borrow is set, the node points at str (which must be external data) instead
+// of holding a copy of it.
+static void insert_at(rope *r, rope_iter *iter, const uint8_t *str, size_t num_bytes, size_t num_chars,
+		      bool borrow)
 {
+	size_t num_newlines = count_newlines(str, num_bytes);
 #if ROPE_WCHAR
 	size_t num_wchars = count_wchars_in_utf8(str, num_chars);
 #endif
@@ -449,7 +623,14 @@ static void insert_at(rope *r, rope_iter *iter, const uint8_t *str, size_t num_b
 	uint8_t	   new_height = random_height();
 	rope_node *new_node   = alloc_node(r, new_height);
 	new_node->num_bytes   = num_bytes;
-	memcpy(new_node->str, str, num_bytes);
+	if (borrow) {
+		new_node->str	= (uint8_t *)str;
+		new_node->chunk = NULL;
+	}
+	else {
+		alloc_chunk(r, new_node);
+		memcpy(new_node->str, str, num_bytes);
+	}
 
 	assert(new_height < ROPE_MAX_HEIGHT);
 
@@ -470,12 +651,16 @@ static void insert_at(rope *r, rope_iter *iter, const uint8_t *str, size_t num_b
 		new_node->nexts[i].node	     = prev_skip->node;
 		new_node->nexts[i].skip_size = num_chars + prev_skip->skip_size - iter->s[i].skip_size;
 
-		prev_skip->node	     = new_node;
-		prev_skip->skip_size = iter->s[i].skip_size;
+		new_node->nexts[i].newline_size = num_newlines + prev_skip->newline_size - iter->s[i].newline_size;
+
+		prev_skip->node		= new_node;
+		prev_skip->skip_size	= iter->s[i].skip_size;
+		prev_skip->newline_size = iter->s[i].newline_size;
 
 		// & move the iterator to the end of the newly inserted node.
-		iter->s[i].node	     = new_node;
-		iter->s[i].skip_size = num_chars;
+		iter->s[i].node		= new_node;
+		iter->s[i].skip_size	= num_chars;
+		iter->s[i].newline_size = num_newlines;
 #if ROPE_WCHAR
 		new_node->nexts[i].wchar_size = num_wchars + prev_skip->wchar_size - iter->s[i].wchar_size;
 		prev_skip->wchar_size	      = iter->s[i].wchar_size;
@@ -486,6 +671,8 @@ static void insert_at(rope *r, rope_iter *iter, const uint8_t *str, size_t num_b
 	for (; i < max_height; i++) {
 		iter->s[i].node->nexts[i].skip_size += num_chars;
 		iter->s[i].skip_size += num_chars;
+		iter->s[i].node->nexts[i].newline_size += num_newlines;
+		iter->s[i].newline_size += num_newlines;
 #if ROPE_WCHAR
 		iter->s[i].node->nexts[i].wchar_size += num_wchars;
 		iter->s[i].wchar_size += num_wchars;
@@ -497,8 +684,15 @@ static void insert_at(rope *r, rope_iter *iter, const uint8_t *str, size_t num_b
 }
 
 // Insert the given utf8 string into the rope at the specified position.
-static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, const uint8_t *str)
+static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, const uint8_t *str,
+				       size_t num_inserted_bytes)
 {
+	// We might be able to insert the new data into the current node, depending on
+	// how big it is. Check that its valid utf8, and count it while we're at it.
+	size_t num_inserted_chars, num_inserted_wchars;
+	if (!utf8_check_and_count(str, num_inserted_bytes, &num_inserted_chars, &num_inserted_wchars))
+		return ROPE_INVALID_UTF8;
+
 	// iter.offset contains how far (in characters) into the current element to skip.
 	// Figure out how much that is in bytes.
 	size_t offset_bytes = 0;
@@ -506,17 +700,11 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 	size_t offset = iter->s[0].skip_size;
 	if (offset) {
 		assert(offset <= e->nexts[0].skip_size);
-		offset_bytes = count_bytes_in_utf8(e->str, offset);
+		offset_bytes = utf8_count_bytes(e->str, offset);
 	}
 
-	// We might be able to insert the new data into the current node, depending on
-	// how big it is. We'll count the bytes, and also check that its valid utf8.
-	ssize_t num_inserted_bytes = bytelen_and_check_utf8(str);
-	if (num_inserted_bytes == -1)
-		return ROPE_INVALID_UTF8;
-
 	// Can we insert into the current node?
-	bool insert_here = e->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE;
+	bool insert_here = e->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE && !node_is_external(r, e);
 
 	// Can we insert into the subsequent node?
 	rope_node *next = NULL;
@@ -527,7 +715,8 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 		// - There _is_ a next node to insert into
 		// - The insert would be at the start of the next node
 		// - There's room in the next node
-		if (next && next->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE) {
+		// - The next node isn't external
+		if (next && next->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE && !node_is_external(r, next)) {
 			offset = offset_bytes = 0;
 			for (int i = 0; i < next->height; i++) {
 				iter->s[i].node = next;
@@ -540,6 +729,8 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 	}
 
 	if (insert_here) {
+		unshare_node(r, e);
+
 		// First move the current bytes later on in the string.
 		if (offset_bytes < e->num_bytes) {
 			memmove(&e->str[offset_bytes + num_inserted_bytes], &e->str[offset_bytes],
@@ -551,15 +742,14 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 		e->num_bytes += num_inserted_bytes;
 
 		r->num_bytes += num_inserted_bytes;
-		size_t num_inserted_chars = strlen_utf8(str);
 		r->num_chars += num_inserted_chars;
+		size_t num_inserted_newlines = count_newlines(str, num_inserted_bytes);
 
 		// .... aaaand update all the offset amounts.
 #if ROPE_WCHAR
-		size_t num_inserted_wchars = count_wchars_in_utf8(str, num_inserted_chars);
-		update_offset_list(r, iter, num_inserted_chars, num_inserted_wchars);
+		update_offset_list(r, iter, num_inserted_chars, num_inserted_newlines, num_inserted_wchars);
 #else
-		update_offset_list(r, iter, num_inserted_chars);
+		update_offset_list(r, iter, num_inserted_chars, num_inserted_newlines);
 #endif
 	}
 	else {
@@ -567,17 +757,18 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 
 		// If we're not at the end of the current node, we'll need to remove
 		// the end of the current node's data and reinsert it later.
-		size_t num_end_chars, num_end_bytes = e->num_bytes - offset_bytes;
+		size_t num_end_chars = 0, num_end_bytes = e->num_bytes - offset_bytes;
 		if (num_end_bytes) {
 			// We'll pretend like the character have been deleted from the node, while leaving
 			// the bytes themselves there (for later).
-			e->num_bytes  = offset_bytes;
-			num_end_chars = e->nexts[0].skip_size - offset;
+			e->num_bytes	       = offset_bytes;
+			num_end_chars	       = e->nexts[0].skip_size - offset;
+			size_t num_end_newlines = count_newlines(&e->str[offset_bytes], num_end_bytes);
 #if ROPE_WCHAR
 			size_t num_end_wchars = count_wchars_in_utf8(&e->str[offset_bytes], num_end_chars);
-			update_offset_list(r, iter, -num_end_chars, -num_end_wchars);
+			update_offset_list(r, iter, -num_end_chars, -num_end_newlines, -num_end_wchars);
 #else
-			update_offset_list(r, iter, -num_end_chars);
+			update_offset_list(r, iter, -num_end_chars, -num_end_newlines);
 #endif
 
 			r->num_chars -= num_end_chars;
@@ -587,13 +778,13 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 		// Now we insert new nodes containing the new character data. The data must be broken into
 		// pieces of with a maximum size of ROPE_NODE_STR_SIZE. Node boundaries must not occur in the
 		// middle of a utf8 codepoint.
-		ssize_t str_offset = 0;
+		size_t str_offset = 0;
 		while (str_offset < num_inserted_bytes) {
-			ssize_t new_node_bytes = 0;
-			ssize_t new_node_chars = 0;
+			size_t new_node_bytes = 0;
+			size_t new_node_chars = 0;
 
 			while (str_offset + new_node_bytes < num_inserted_bytes) {
-				size_t cs = codepoint_size(str[str_offset + new_node_bytes]);
+				size_t cs = utf8_codepoint_size(str[str_offset + new_node_bytes]);
 				if (cs + new_node_bytes > ROPE_NODE_STR_SIZE) {
 					break;
 				}
@@ -603,12 +794,13 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 				}
 			}
 
-			insert_at(r, iter, &str[str_offset], new_node_bytes, new_node_chars);
+			insert_at(r, iter, &str[str_offset], new_node_bytes, new_node_chars, false);
 			str_offset += new_node_bytes;
 		}
 
 		if (num_end_bytes) {
-			insert_at(r, iter, &e->str[offset_bytes], num_end_bytes, num_end_chars);
+			// The end of an external node stays where it is, in a node of its own.
+			insert_at(r, iter, &e->str[offset_bytes], num_end_bytes, num_end_chars, node_is_external(r, e));
 		}
 	}
 
@@ -617,8 +809,14 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 
 ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str)
 {
-	assert(r);
 	assert(str);
+	return rope_insert_n(r, pos, str, strlen((const char *)str));
+}
+
+ROPE_RESULT rope_insert_n(rope *r, size_t pos, const uint8_t *str, size_t num_bytes)
+{
+	assert(r);
+	assert(str || num_bytes == 0);
 #ifdef DEBUG
 	_rope_check(r);
 #endif
@@ -628,7 +826,7 @@ ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str)
 	// First we need to search for the node where we'll insert the string.
 	rope_node *e = iter_at_char_pos(r, pos, &iter);
 
-	ROPE_RESULT result = rope_insert_at_iter(r, e, &iter, str);
+	ROPE_RESULT result = rope_insert_at_iter(r, e, &iter, str, num_bytes);
 
 #ifdef DEBUG
 	_rope_check(r);
@@ -637,6 +835,157 @@ ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str)
 	return result;
 }
 
+// Pick the height of the n'th node (counting from 1) of a rope built in one go.
+// Instead of rolling dice, every (100 / ROPE_BIAS)'th node is one level taller,
+// which gives the same distribution of heights as random_height, evenly spread.
+static uint8_t bulk_height(size_t n)
+{
+	const size_t period = ROPE_BIAS ? MAX(100 / ROPE_BIAS, 2) : 0;
+
+	uint8_t height = 1;
+	while (period && height < (ROPE_MAX_HEIGHT - 1) && n % period == 0) {
+		n /= period;
+		height++;
+	}
+	return height;
+}
+
+// Fill an empty rope with the contents of buf in a single pass, with nodes of up to
+// max_node_bytes bytes. If borrow is set the nodes point into buf instead of holding
+// a copy of it. Returns false if the buffer isn't valid utf8.
+static bool fill_rope(rope *r, const uint8_t *buf, size_t num_bytes, size_t max_node_bytes, bool borrow)
+{
+	// The last node seen at each height, and the position it started at. The
+	// node's nexts entry is filled in once the next node that tall turns up.
+	rope_node *last[ROPE_MAX_HEIGHT];
+	size_t	   last_chars[ROPE_MAX_HEIGHT]	  = {};
+	size_t	   last_newlines[ROPE_MAX_HEIGHT] = {};
+#if ROPE_WCHAR
+	size_t last_wchars[ROPE_MAX_HEIGHT] = {};
+	size_t num_wchars		    = 0;
+#endif
+	for (int i = 0; i < ROPE_MAX_HEIGHT; i++) {
+		last[i] = &r->head;
+	}
+
+	size_t num_chars    = 0;
+	size_t num_newlines = 0;
+	size_t num_nodes    = 0;
+
+	const uint8_t *p   = buf;
+	const uint8_t *end = buf + num_bytes;
+	while (p < end) {
+		// Take as many whole characters as fit in a node, by backing up from the
+		// node size limit to the start of a character.
+		const uint8_t *start = p;
+		p		     = start + MIN(max_node_bytes, (size_t)(end - start));
+		while (p < end && p > start && (*p & 0xc0) == 0x80) {
+			p--;
+		}
+		if (p == start) {
+			// Nothing but continuation bytes.
+			return false;
+		}
+
+		size_t node_bytes = p - start;
+		size_t node_chars, node_wchars;
+		if (!utf8_check_and_count(start, node_bytes, &node_chars, &node_wchars)) {
+			return false;
+		}
+
+		size_t	   node_newlines = count_newlines(start, node_bytes);
+		uint8_t	   height	 = bulk_height(++num_nodes);
+		rope_node *node		 = alloc_node(r, height);
+		if (borrow) {
+			node->str   = (uint8_t *)start;
+			node->chunk = NULL;
+		}
+		else {
+			alloc_chunk(r, node);
+			memcpy(node->str, start, node_bytes);
+		}
+		node->num_bytes = node_bytes;
+
+		if (r->head.height <= height) {
+			r->head.height = height + 1;
+		}
+
+		for (int i = 0; i < height; i++) {
+			rope_skip_node *skip = &last[i]->nexts[i];
+			skip->node	     = node;
+			skip->skip_size	     = num_chars - last_chars[i];
+			skip->newline_size   = num_newlines - last_newlines[i];
+#if ROPE_WCHAR
+			skip->wchar_size = num_wchars - last_wchars[i];
+			last_wchars[i]	 = num_wchars;
+#endif
+			last[i]		 = node;
+			last_chars[i]	 = num_chars;
+			last_newlines[i] = num_newlines;
+		}
+
+		num_chars += node_chars;
+		num_newlines += node_newlines;
+#if ROPE_WCHAR
+		num_wchars += node_wchars;
+#endif
+	}
+
+	// Terminate the list at every height.
+	for (int i = 0; i < r->head.height; i++) {
+		last[i]->nexts[i].node	       = NULL;
+		last[i]->nexts[i].skip_size    = num_chars - last_chars[i];
+		last[i]->nexts[i].newline_size = num_newlines - last_newlines[i];
+#if ROPE_WCHAR
+		last[i]->nexts[i].wchar_size = num_wchars - last_wchars[i];
+#endif
+	}
+
+	r->num_chars = num_chars;
+	r->num_bytes = num_bytes;
+	return true;
+}
+
+rope *rope_new_from_buffer(const uint8_t *buf, size_t num_bytes)
+{
+	rope *r = rope_new();
+	if (!fill_rope(r, buf, num_bytes, ROPE_NODE_STR_SIZE, false)) {
+		rope_free(r);
+		return NULL;
+	}
+
+#ifdef DEBUG
+	_rope_check(r);
+#endif
+	return r;
+}
+
+rope *rope_new_with_external(const uint8_t *buf, size_t num_bytes,
+			     void (*release)(const uint8_t *buf, size_t num_bytes, void *ctx), void *ctx)
+{
+	rope	      *r = rope_new();
+	rope_external *e = (rope_external *)r->alloc(sizeof(rope_external));
+	e->refs		 = 1;
+	e->buf		 = buf;
+	e->num_bytes	 = num_bytes;
+	e->release	 = release;
+	e->ctx		 = ctx;
+	r->external	 = e;
+
+	if (!fill_rope(r, buf, num_bytes, ROPE_EXTERNAL_NODE_SIZE, true)) {
+		// The caller still owns the buffer.
+		r->external = NULL;
+		r->free(e);
+		rope_free(r);
+		return NULL;
+	}
+
+#ifdef DEBUG
+	_rope_check(r);
+#endif
+	return r;
+}
+
 #if ROPE_WCHAR
 // Insert the given utf8 string into the rope at the specified position.
 size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *str)
@@ -652,7 +1001,7 @@ size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *str)
 	// First we need to search for the node where we'll insert the string.
 	rope_node *e   = iter_at_wchar_pos(r, wchar_pos, &iter);
 	size_t	   pos = iter.s[r->head.height - 1].skip_size;
-	rope_insert_at_iter(r, e, &iter, str);
+	rope_insert_at_iter(r, e, &iter, str, strlen((const char *)str));
 
 #ifdef DEBUG
 	_rope_check(r);
@@ -677,27 +1026,46 @@ static void rope_del_at_iter(rope *r, rope_node *e, rope_iter *iter, size_t leng
 
 		size_t num_chars = e->nexts[0].skip_size;
 		size_t removed	 = MIN(length, num_chars - offset);
+		size_t removed_newlines;
 #if ROPE_WCHAR
 		size_t removed_wchars;
 #endif
+		// The bytes at the end of an external node which need to be split off.
+		const uint8_t *split	   = NULL;
+		size_t	       split_bytes = 0;
 
 		int i;
 		if (removed < num_chars || e == &r->head) {
 			// Just trim this node down to size.
-			size_t leading_bytes  = count_bytes_in_utf8(e->str, offset);
-			size_t removed_bytes  = count_bytes_in_utf8(&e->str[leading_bytes], removed);
+			size_t leading_bytes  = utf8_count_bytes(e->str, offset);
+			size_t removed_bytes  = utf8_count_bytes(&e->str[leading_bytes], removed);
 			size_t trailing_bytes = e->num_bytes - leading_bytes - removed_bytes;
+			removed_newlines      = count_newlines(&e->str[leading_bytes], removed_bytes);
 #if ROPE_WCHAR
 			removed_wchars = count_wchars_in_utf8(&e->str[leading_bytes], removed);
 #endif
-			if (trailing_bytes) {
+			if (trailing_bytes == 0) {
+				// Nothing to move.
+			}
+			else if (!node_is_external(r, e)) {
+				unshare_node(r, e);
 				memmove(&e->str[leading_bytes], &e->str[leading_bytes + removed_bytes], trailing_bytes);
 			}
+			else if (leading_bytes == 0) {
+				// External data can't be moved, but the node can start further into it.
+				e->str += removed_bytes;
+			}
+			else {
+				// Or end earlier, with the trailing bytes moved to a new node below.
+				split	    = &e->str[leading_bytes + removed_bytes];
+				split_bytes = trailing_bytes;
+			}
 			e->num_bytes -= removed_bytes;
 			r->num_bytes -= removed_bytes;
 
 			for (i = 0; i < e->height; i++) {
 				e->nexts[i].skip_size -= removed;
+				e->nexts[i].newline_size -= removed_newlines;
 #if ROPE_WCHAR
 				e->nexts[i].wchar_size -= removed_wchars;
 #endif
@@ -705,31 +1073,51 @@ static void rope_del_at_iter(rope *r, rope_node *e, rope_iter *iter, size_t leng
 		}
 		else {
 			// Remove the node from the list
+			removed_newlines = e->nexts[0].newline_size;
 #if ROPE_WCHAR
 			removed_wchars = e->nexts[0].wchar_size;
 #endif
 			for (i = 0; i < e->height; i++) {
 				iter->s[i].node->nexts[i].node = e->nexts[i].node;
 				iter->s[i].node->nexts[i].skip_size += e->nexts[i].skip_size - removed;
+				iter->s[i].node->nexts[i].newline_size += e->nexts[i].newline_size - removed_newlines;
 #if ROPE_WCHAR
 				iter->s[i].node->nexts[i].wchar_size += e->nexts[i].wchar_size - removed_wchars;
 #endif
 			}
 
 			r->num_bytes -= e->num_bytes;
-			// TODO: Recycle e.
 			rope_node *next = e->nexts[0].node;
-			r->free(e);
+			free_node(r, e);
 			e = next;
 		}
 
 		for (; i < r->head.height; i++) {
 			iter->s[i].node->nexts[i].skip_size -= removed;
+			iter->s[i].node->nexts[i].newline_size -= removed_newlines;
 #if ROPE_WCHAR
 			iter->s[i].node->nexts[i].wchar_size -= removed_wchars;
 #endif
 		}
 
+		if (split_bytes) {
+			// This only happens in the node the deletion started in, where the iterator points
+			// exactly at the end of the remaining leading bytes. Pretend the trailing bytes were
+			// deleted as well, then insert them again as a new node borrowing the same data.
+			size_t split_chars    = num_chars - offset - removed;
+			size_t split_newlines = count_newlines(split, split_bytes);
+			e->num_bytes -= split_bytes;
+			r->num_bytes -= split_bytes;
+			r->num_chars -= split_chars;
+#if ROPE_WCHAR
+			size_t split_wchars = count_wchars_in_utf8(split, split_chars);
+			update_offset_list(r, iter, -split_chars, -split_newlines, -split_wchars);
+#else
+			update_offset_list(r, iter, -split_chars, -split_newlines);
+#endif
+			insert_at(r, iter, split, split_bytes, split_chars, true);
+		}
+
 		length -= removed;
 	}
 }
@@ -791,6 +1179,80 @@ size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *ch
 }
 #endif
 
+rope_node *rope_node_at(rope *r, size_t char_pos, size_t *byte_offset)
+{
+	assert(r);
+	assert(byte_offset);
+	char_pos = MIN(char_pos, r->num_chars);
+
+	rope_iter  iter;
+	rope_node *e = iter_at_char_pos(r, char_pos, &iter);
+
+	*byte_offset = utf8_count_bytes(e->str, iter.s[0].skip_size);
+	return e;
+}
+
+size_t rope_line_to_char(const rope *r, size_t line)
+{
+	assert(r);
+	int height = r->head.height - 1;
+
+	if (line == 0) {
+		return 0;
+	}
+	if (line > r->head.nexts[height].newline_size) {
+		return r->num_chars;
+	}
+
+	// We're looking for the node containing the line'th newline. Skip over every
+	// span which doesn't contain it, keeping track of the characters we've passed.
+	const rope_node *e	   = &r->head;
+	size_t		 remaining = line;
+	size_t		 char_pos  = 0;
+
+	while (true) {
+		const rope_skip_node *skip = &e->nexts[height];
+		if (remaining > skip->newline_size) {
+			// Go right.
+			remaining -= skip->newline_size;
+			char_pos += skip->skip_size;
+			e = skip->node;
+		}
+		else if (height == 0) {
+			break;
+		}
+		else {
+			// Go down.
+			height--;
+		}
+	}
+
+	// The line starts just after the remaining'th newline in e.
+	const uint8_t *p = e->str;
+	while (true) {
+		p = (const uint8_t *)memchr(p, '\n', e->num_bytes - (p - e->str));
+		assert(p);
+		p++;
+		if (--remaining == 0) {
+			break;
+		}
+	}
+
+	return char_pos + utf8_count_chars(e->str, p - e->str);
+}
+
+size_t rope_char_to_line(rope *r, size_t char_pos)
+{
+	assert(r);
+	char_pos = MIN(char_pos, r->num_chars);
+
+	rope_iter iter;
+	iter_at_char_pos(r, char_pos, &iter);
+
+	// The top of the iterator spans from the start of the rope to the position.
+	return iter.s[r->head.height - 1].newline_size;
+}
+
 void _rope_check(rope *r)
 {
 	assert(r->head.height); // Even empty ropes have a height of 1.
@@ -800,8 +1262,9 @@ void _rope_check(rope *r)
 	assert(skip_over.skip_size == r->num_chars);
 	assert(skip_over.node == NULL);
 
-	size_t num_bytes = 0;
-	size_t num_chars = 0;
+	size_t num_bytes    = 0;
+	size_t num_chars    = 0;
+	size_t num_newlines = 0;
 #if ROPE_WCHAR
 	size_t num_wchar = 0;
 #endif
@@ -815,16 +1278,22 @@ void _rope_check(rope *r)
 
 	for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
 		assert(n == &r->head || n->num_bytes);
+		assert(node_is_external(r, n) || n->num_bytes <= ROPE_NODE_STR_SIZE);
+		assert(!node_is_external(r, n) || r->external != NULL);
+		assert(n->chunk == NULL || (n->str == n->chunk->str && n->chunk->refs > 0));
 		assert(n->height <= ROPE_MAX_HEIGHT);
-		assert(count_bytes_in_utf8(n->str, n->nexts[0].skip_size) == n->num_bytes);
+		assert(utf8_count_bytes(n->str, n->nexts[0].skip_size) == n->num_bytes);
+		assert(count_newlines(n->str, n->num_bytes) == n->nexts[0].newline_size);
 #if ROPE_WCHAR
 		assert(count_wchars_in_utf8(n->str, n->nexts[0].skip_size) == n->nexts[0].wchar_size);
 #endif
 		for (int i = 0; i < n->height; i++) {
 			assert(iter.s[i].node == n);
 			assert(iter.s[i].skip_size == num_chars);
+			assert(iter.s[i].newline_size == num_newlines);
 			iter.s[i].node = n->nexts[i].node;
 			iter.s[i].skip_size += n->nexts[i].skip_size;
+			iter.s[i].newline_size += n->nexts[i].newline_size;
 #if ROPE_WCHAR
 			assert(iter.s[i].wchar_size == num_wchar);
 			iter.s[i].wchar_size += n->nexts[i].wchar_size;
@@ -833,6 +1302,7 @@ void _rope_check(rope *r)
 
 		num_bytes += n->num_bytes;
 		num_chars += n->nexts[0].skip_size;
+		num_newlines += n->nexts[0].newline_size;
 #if ROPE_WCHAR
 		num_wchar += n->nexts[0].wchar_size;
 #endif
@@ -841,6 +1311,7 @@ void _rope_check(rope *r)
 	for (int i = 0; i < r->head.height; i++) {
 		assert(iter.s[i].node == NULL);
 		assert(iter.s[i].skip_size == num_chars);
+		assert(iter.s[i].newline_size == num_newlines);
 #if ROPE_WCHAR
 		assert(iter.s[i].wchar_size == num_wchar);
 #endif
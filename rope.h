@@ -6,7 +6,8 @@
  * It uses skip lists instead of trees. Trees might be faster - who knows?
  *
  * Ropes are not syncronized. Do not access the same rope from multiple threads
- * simultaneously.
+ * simultaneously. A rope and its copies share node data, so while one thread
+ * edits or frees a rope, other threads may only read its copies.
  */
 
 #ifndef librope_rope_h
@@ -25,8 +26,8 @@
 #define ROPE_WCHAR 0
 #endif
 
-// These two magic values seem to be approximately optimal given the benchmark
-// in tests.c which does lots of small inserts.
+// These two magic values seem to be approximately optimal for lots of small
+// inserts. Run make bench to compare other settings (see bench/rope.c).
 
 // Must be <= UINT16_MAX. Benchmarking says this is pretty close to optimal
 // (tested on a mac using clang 4.0 and x86_64).
@@ -49,7 +50,22 @@
 #define ROPE_MAX_HEIGHT 60
 #endif
 
+// Nodes are allocated out of slabs of about this many bytes. Each slab only
+// holds nodes of a single height.
+#ifndef ROPE_POOL_SLAB_SIZE
+#define ROPE_POOL_SLAB_SIZE 4096
+#endif
+
+// Ropes created with rope_new_with_external refer to the caller's buffer in
+// pieces of up to this many bytes instead of copying it. Must be <= UINT16_MAX.
+#ifndef ROPE_EXTERNAL_NODE_SIZE
+#define ROPE_EXTERNAL_NODE_SIZE 16384
+#endif
+
 struct rope_node_t;
+struct rope_chunk_t;
+struct rope_chunk_pool_t;
+struct rope_external_t;
 
 // The number of characters in str can be read out of nexts[0].skip_size.
 typedef struct {
@@ -61,6 +77,11 @@ typedef struct {
 	// exactly _here_ in the struct.
 	struct rope_node_t *node;
 
+	// The number of newline ('\n') characters between the start of the current
+	// node and the start of next. This lets us map line numbers to character
+	// offsets by walking down the skip list.
+	size_t newline_size;
+
 #if ROPE_WCHAR
 	// The number of wide characters contained in space.
 	size_t wchar_size;
@@ -68,7 +89,16 @@ typedef struct {
 } rope_skip_node;
 
 typedef struct rope_node_t {
-	uint8_t str[ROPE_NODE_STR_SIZE];
+	// The node's data. This normally points at the ROPE_NODE_STR_SIZE bytes
+	// of chunk. Nodes of a rope created with rope_new_with_external may instead
+	// point into the external buffer, in which case the data is read only and
+	// may be longer.
+	uint8_t *str;
+
+	// The reference counted storage holding str, which a rope shares with its
+	// copies until one of them writes to it. NULL for the head, which stores
+	// its data inline, and for nodes pointing into an external buffer.
+	struct rope_chunk_t *chunk;
 
 	// The number of bytes in str in use
 	uint16_t num_bytes;
@@ -91,6 +121,18 @@ typedef struct {
 	void *(*realloc)(void *ptr, size_t newsize);
 	void (*free)(void *ptr);
 
+	// Node pool. Nodes are carved out of slabs allocated with alloc, and freed
+	// nodes are kept on a free list for their height (which determines their
+	// size) to be reused. The slabs are all released at once by rope_free.
+	struct rope_node_t *free_nodes[ROPE_MAX_HEIGHT];
+	void		   *slabs;
+
+	// Chunk pool, shared by the rope and all copies made of it.
+	struct rope_chunk_pool_t *chunks;
+
+	// The external buffer nodes may point into, or NULL.
+	struct rope_external_t *external;
+
 	// The first node exists inline in the rope structure itself.
 	rope_node head;
 } rope;
@@ -109,7 +151,26 @@ rope *rope_new2(void *(*alloc)(size_t bytes), void *(*realloc)(void *ptr, size_t
 // r = rope_new(); rope_insert(r, 0, str);
 rope *rope_new_with_utf8(const uint8_t *str);
 
-// Make a copy of an existing rope
+// Create a new rope containing a copy of the num_bytes bytes at buf. Unlike
+// rope_insert the buffer doesn't need to be null terminated, and the rope is
+// built in a single pass with every node packed full. Returns NULL if the
+// buffer isn't valid utf8.
+rope *rope_new_from_buffer(const uint8_t *buf, size_t num_bytes);
+
+// Create a new rope which refers to the num_bytes bytes at buf instead of
+// copying them. Only the parts of the rope which are edited get copied into
+// nodes of their own. This is meant for very large, read only buffers such as
+// an mmap'ed file.
+//
+// buf must stay valid and unchanged until release(buf, num_bytes, ctx) is
+// called, which happens when the rope and all copies of it have been freed.
+// Returns NULL, without calling release, if the buffer isn't valid utf8.
+rope *rope_new_with_external(const uint8_t *buf, size_t num_bytes,
+			     void (*release)(const uint8_t *buf, size_t num_bytes, void *ctx), void *ctx);
+
+// Make a copy of an existing rope. The copy shares its text with r, so this
+// only allocates node headers. Whichever rope is edited first copies the nodes
+// the edit writes to.
 rope *rope_copy(const rope *r);
 
 // Free the specified rope
@@ -122,6 +183,17 @@ size_t rope_char_count(const rope *r);
 // string
 size_t rope_byte_count(const rope *r);
 
+// Get the number of lines in the rope. This is the number of newlines + 1, so
+// an empty rope has a single (empty) line.
+size_t rope_line_count(const rope *r);
+
+// Get the character offset of the start of the given (zero based) line. Lines
+// past the end of the rope map to rope_char_count(r).
+size_t rope_line_to_char(const rope *r, size_t line);
+
+// Get the (zero based) line which contains the given character offset.
+size_t rope_char_to_line(rope *r, size_t char_pos);
+
 // Copies the rope's contents into a utf8 encoded C string. Also copies a
 // trailing '\0' character.
 // Returns the number of bytes written, which is rope_byte_count(r) + 1.
@@ -139,6 +211,10 @@ typedef enum { ROPE_OK, ROPE_INVALID_UTF8 } ROPE_RESULT;
 // Insert the given utf8 string into the rope at the specified position.
 ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str);
 
+// Insert the num_bytes bytes of utf8 at str into the rope at the specified
+// position. The string doesn't need to be null terminated.
+ROPE_RESULT rope_insert_n(rope *r, size_t pos, const uint8_t *str, size_t num_bytes);
+
 // Delete num characters at position pos. Deleting past the end of the string
 // has no effect.
 void rope_del(rope *r, size_t pos, size_t num);
@@ -153,6 +229,15 @@ void rope_del(rope *r, size_t pos, size_t num);
 //  }
 #define ROPE_FOREACH(rope, iter) for (rope_node *iter = &(rope)->head; iter != NULL; iter = iter->nexts[0].node)
 
+// Get the node following n, or NULL if n is the last node in the rope.
+static inline rope_node *rope_node_next(rope_node *n) { return n->nexts[0].node; }
+
+// Find the node containing the specified character position. *byte_offset is
+// set to the byte offset of the position within the node's data. Together with
+// rope_node_next this lets callers read a range of the rope in place, without
+// copying it out first.
+rope_node *rope_node_at(rope *r, size_t char_pos, size_t *byte_offset);
+
 // Get the actual data inside a rope node.
 static inline uint8_t *rope_node_data(rope_node *n) { return n->str; }
 
@@ -163,6 +248,9 @@ static inline size_t rope_node_num_bytes(rope_node *n) { return n->num_bytes; }
 // Get the number of characters inside a rope node.
 static inline size_t rope_node_chars(rope_node *n) { return n->nexts[0].skip_size; }
 
+// Get the number of newlines inside a rope node.
+static inline size_t rope_node_newlines(rope_node *n) { return n->nexts[0].newline_size; }
+
 #if ROPE_WCHAR
 // Get the number of wchar characters in the rope
 size_t rope_wchar_count(rope *r);
@@ -1,19 +1,32 @@
+#include "re.h"
 #include "rope.h"
+#include "utf8.h"
+#include "width.h"
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <mach/mach_time.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 void debug(const char *fmt, ...)
 {
@@ -29,16 +42,23 @@ void debug(const char *fmt, ...)
 	fclose(f);
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 #define BENCH(N, code_block)                                                                                           \
 	do {                                                                                                           \
-		mach_timebase_info_data_t _info;                                                                       \
-		mach_timebase_info(&_info);                                                                            \
-		uint64_t _start = mach_absolute_time();                                                                \
+		struct timespec _start, _end;                                                                          \
+		clock_gettime(CLOCK_MONOTONIC, &_start);                                                               \
 		for (int _i = 0; _i < (N); _i++) {                                                                     \
 			code_block;                                                                                    \
 		}                                                                                                      \
-		uint64_t _end	     = mach_absolute_time();                                                           \
-		uint64_t _elapsed_ns = (_end - _start) * _info.numer / _info.denom;                                    \
+		clock_gettime(CLOCK_MONOTONIC, &_end);                                                                 \
+		uint64_t _elapsed_ns = (uint64_t)(_end.tv_sec - _start.tv_sec) * 1000000000 + _end.tv_nsec -           \
+				       _start.tv_nsec;                                                                 \
 		debug("Benchmark (%d runs): total = %8llu ns, average = "                                              \
 		      "%8llu ns\n",                                                                                    \
 		      (N), (unsigned long long)_elapsed_ns, (unsigned long long)(_elapsed_ns / (N)));                  \
@@ -47,14 +67,19 @@ void debug(const char *fmt, ...)
 enum editor_mode {
 	EDITOR_MODE_NORMAL,
 	EDITOR_MODE_INSERT,
+	EDITOR_MODE_SEARCH,
+	EDITOR_MODE_REGEX,
+	EDITOR_MODE_GREP,
+	EDITOR_MODE_GOTO,
 };
 
 struct editor_state {
 	enum editor_mode mode;
 };
 
-#define TERMINAL_MODE_ALTERNATE "\e[?1049h", 8
-#define TERMINAL_MODE_NORMAL	"\e[?1049l\e[1000;1H", 15
+// Switching modes also turns bracketed paste on and off.
+#define TERMINAL_MODE_ALTERNATE "\e[?1049h\e[?2004h", 16
+#define TERMINAL_MODE_NORMAL	"\e[?2004l\e[?1049l\e[1000;1H", 23
 #define TERMINAL_CURSOR_HIDE	"\e[?25l", 6
 #define TERMINAL_CURSOR_SHOW	"\e[?25h", 6
 #define TERMINAL_CURSOR_RESET	"\e[1;1H", 6
@@ -63,6 +88,11 @@ struct editor_state {
 #define TERMINAL_FRAME_START	"\e[?25l\e[1;1H", 12
 #define TERMINAL_FRAME_END	"\e[1;1H\e[?25h", 12
 
+// With bracketed paste on, the terminal wraps pasted text in these.
+#define TERMINAL_PASTE_START	  "\e[200~"
+#define TERMINAL_PASTE_END	  "\e[201~"
+#define TERMINAL_PASTE_MARKER_LEN 6
+
 struct terminal_config {
 	int	       fd;
 	struct termios termios;
@@ -88,6 +118,7 @@ int terminal_init(struct terminal_config *term)
 
 	struct termios raw = term->termios;
 	raw.c_lflag &= ~(ECHO | ICANON | ISIG);
+	raw.c_iflag &= ~IXON; // Let ^S and ^Q through
 	raw.c_cc[VMIN]	= 1;
 	raw.c_cc[VTIME] = 0;
 
@@ -151,25 +182,87 @@ struct bounds {
 	int height;
 };
 
+// How a cell is drawn: a foreground colour in the low bits, and styles. Cells
+// with RENDER_ATTR_NORMAL are drawn however the terminal draws plain text.
+#define RENDER_ATTR_NORMAL    0x00
+#define RENDER_ATTR_FG_MASK   0x0f
+#define RENDER_ATTR_BOLD      0x10
+#define RENDER_ATTR_UNDERLINE 0x20
+#define RENDER_ATTR_REVERSE   0x40
+
+// Foreground colours, in the order of their SGR codes after the default one.
+enum render_color {
+	RENDER_COLOR_DEFAULT,
+	RENDER_COLOR_BLACK,
+	RENDER_COLOR_RED,
+	RENDER_COLOR_GREEN,
+	RENDER_COLOR_YELLOW,
+	RENDER_COLOR_BLUE,
+	RENDER_COLOR_MAGENTA,
+	RENDER_COLOR_CYAN,
+	RENDER_COLOR_WHITE,
+};
+
+// A cell of the screen holds the codepoint drawn in it, or this if it's the
+// right half of a wide character.
+#define RENDER_CELL_WIDE 0
+
+// Tab stops are this many columns apart.
+#ifndef RENDER_TAB_WIDTH
+#define RENDER_TAB_WIDTH 8
+#endif
+
 struct render_context {
-	char *screen_buffer;
-	int   rows;
-	int   cols;
+	uint32_t *screen_buffer;
+	uint8_t	 *attr_buffer; // The RENDER_ATTR_* of each cell of screen_buffer
+	int	  rows;
+	int	  cols;
+
+	// The frame which was last flushed to the terminal. Only the cells which
+	// differ from it are written out on the next render.
+	uint32_t *front_buffer;
+	uint8_t	 *front_attrs;
+	bool	  front_valid;
+
+	// Escape sequences and cell runs for the frame being rendered are gathered
+	// here so that a frame costs a single write.
+	char *out;
+	int   out_len;
+	int   out_cap;
+
+	// The number of bytes emitted for the last frame.
+	int frame_bytes;
 };
 
+// Unchanged gaps shorter than this are rewritten instead of jumping over them
+// with a cursor positioning sequence, which is about as long.
+#define RENDER_CONTEXT_MAX_GAP 8
+
 int  render_context_init(struct render_context *ctx, int rows, int cols);
 void render_context_clear(struct render_context *ctx);
-int  render_context_render(struct render_context *ctx, int fd, int cursor_col, int cursor_row);
+void render_context_set_attrs(struct render_context *ctx, int row, int col, int len, uint8_t attr);
+int  render_context_put_text(struct render_context *ctx, int row, int col, int end, const char *str, int len);
+int  render_context_render(struct render_context *ctx, int fd, int cursor_row, int cursor_col);
 void render_context_cleanup(struct render_context *ctx);
 
 int render_context_init(struct render_context *ctx, int rows, int cols)
 {
-	ctx->screen_buffer = malloc(rows * cols);
-	if (ctx->screen_buffer == NULL) {
+	ctx->screen_buffer = malloc(rows * cols * sizeof(*ctx->screen_buffer));
+	ctx->attr_buffer   = malloc(rows * cols);
+	ctx->front_buffer  = malloc(rows * cols * sizeof(*ctx->front_buffer));
+	ctx->front_attrs   = malloc(rows * cols);
+	ctx->out_cap	   = rows * cols * 2 + 64;
+	ctx->out	   = malloc(ctx->out_cap);
+	if (ctx->screen_buffer == NULL || ctx->attr_buffer == NULL || ctx->front_buffer == NULL ||
+	    ctx->front_attrs == NULL || ctx->out == NULL) {
+		render_context_cleanup(ctx);
 		return -1;
 	}
-	ctx->rows = rows;
-	ctx->cols = cols;
+	ctx->rows	 = rows;
+	ctx->cols	 = cols;
+	ctx->front_valid = false;
+	ctx->out_len	 = 0;
+	ctx->frame_bytes = 0;
 	return 0;
 }
 
@@ -178,439 +271,4189 @@ void render_context_clear(struct render_context *ctx)
 	if (ctx->screen_buffer == NULL) {
 		return;
 	}
-	memset(ctx->screen_buffer, ' ', ctx->rows * ctx->cols);
+	for (int i = 0; i < ctx->rows * ctx->cols; i++) {
+		ctx->screen_buffer[i] = ' ';
+	}
+	memset(ctx->attr_buffer, RENDER_ATTR_NORMAL, ctx->rows * ctx->cols);
 }
 
-int render_context_render(struct render_context *ctx, int fd, int cursor_row, int cursor_col)
+// Get the number of columns character c takes up when it starts at column col.
+// Tabs run up to the next tab stop. Other control characters are drawn as ^X,
+// or as U+FFFD past ASCII.
+static int render_char_width(uint32_t c, int col)
 {
-	if (write(fd, TERMINAL_FRAME_START) == -1) {
-		return -1;
-	}
-	if (write(fd, ctx->screen_buffer, ctx->rows * ctx->cols) == -1) {
-		return -1;
+	if (c == '\t') {
+		return RENDER_TAB_WIDTH - col % RENDER_TAB_WIDTH;
 	}
-	char buf[32] = {};
-	int  buf_len = snprintf(buf, sizeof(buf), "\e[%d;%dH", cursor_row + 1, cursor_col + 1);
-	if (write(fd, buf, buf_len) == -1) {
-		return -1;
+	if (c < ' ' || c == 0x7f) {
+		return 2;
 	}
-	if (write(fd, TERMINAL_CURSOR_SHOW) == -1) {
-		return -1;
+	if (c >= 0x80 && c < 0xa0) {
+		return 1;
 	}
-	return 0;
+	return width_codepoint(c);
 }
 
-void render_context_cleanup(struct render_context *ctx)
+// Draw character c at col of row, where it takes up width columns, cutting it
+// off at column end. A wide character which doesn't fit is left out.
+static void render_context_put_char(struct render_context *ctx, int row, int col, int end, uint32_t c, int width)
 {
-	if (ctx->screen_buffer != NULL) {
-		free(ctx->screen_buffer);
-		ctx->screen_buffer = NULL;
+	uint32_t glyph[2] = {c, RENDER_CELL_WIDE};
+	if (c < ' ' || c == 0x7f) {
+		glyph[0] = '^';
+		glyph[1] = c ^ 0x40;
+	}
+	else if (c >= 0x80 && c < 0xa0) {
+		glyph[0] = 0xfffd;
+	}
+
+	end	      = MIN(end, ctx->cols);
+	uint32_t *out = ctx->screen_buffer + row * ctx->cols;
+	if (c == '\t') {
+		for (int i = MAX(col, 0); i < MIN(col + width, end); i++) {
+			out[i] = ' ';
+		}
+	}
+	else if (col >= 0 && col + width <= end) {
+		for (int i = 0; i < width; i++) {
+			out[col + i] = glyph[i];
+		}
 	}
 }
 
-struct file_buffer {
-	rope *rope;
-	char *str;
-	int   str_len;
-	int   cursor_pos;
-	int   cursor_row;
-	int   cursor_col;
+// Draw n printable ASCII characters at col of row, cutting them off at column
+// end. This is what most text is, so it's a straight copy.
+static void render_context_put_ascii(struct render_context *ctx, int row, int col, int end, const uint8_t *str,
+				     int n)
+{
+	uint32_t *out	= ctx->screen_buffer + row * ctx->cols;
+	int	  start = MAX(col, 0);
+	end		= MIN(MIN(end, ctx->cols), col + n);
+	for (int i = start; i < end; i++) {
+		out[i] = str[i - col];
+	}
+}
 
-	struct bounds bounds;
-};
+// Draw the len bytes of utf8 at str from col of row on, cutting it off at column
+// end. Tab stops are counted from col. Returns the column after the text.
+int render_context_put_text(struct render_context *ctx, int row, int col, int end, const char *str, int len)
+{
+	int start = col;
+	for (int i = 0; i < len && col < end;) {
+		// Text cut off part way through a character is drawn as U+FFFD.
+		size_t	 size = utf8_codepoint_size(str[i]);
+		uint32_t c    = 0xfffd;
+		if (size == SIZE_MAX || size > (size_t)(len - i)) {
+			size = 1;
+		}
+		else {
+			c = utf8_decode((const uint8_t *)&str[i], size);
+		}
 
-int  file_buffer_init_from_file(struct file_buffer *file, char *pathname);
-void file_buffer_render_to_context(struct file_buffer *file, struct render_context *ctx, struct bounds *bounds);
-void file_buffer_cleanup(struct file_buffer *file);
+		int width = render_char_width(c, col - start);
+		render_context_put_char(ctx, row, col, end, c, c == '\t' ? MIN(width, end - col) : width);
+		col += width;
+		i += size;
+	}
+	return col;
+}
 
-int file_buffer_init_from_file(struct file_buffer *file, char *pathname)
+// Set the attribute of len cells of row from col on, as far as they're on screen.
+void render_context_set_attrs(struct render_context *ctx, int row, int col, int len, uint8_t attr)
 {
-	struct stat st;
-	if (stat(pathname, &st) == -1) {
-		return -1;
+	if (row < 0 || row >= ctx->rows) {
+		return;
 	}
+	int start = MAX(col, 0);
+	int end	  = MIN(col + len, ctx->cols);
+	if (start < end) {
+		memset(ctx->attr_buffer + row * ctx->cols + start, attr, end - start);
+	}
+}
 
-	int fd = open(pathname, O_RDONLY);
-	if (fd == -1) {
-		return -1;
+// Make room for len more bytes of output.
+static int render_context_reserve(struct render_context *ctx, int len)
+{
+	if (ctx->out_len + len > ctx->out_cap) {
+		int   cap = MAX(ctx->out_cap * 2, ctx->out_len + len);
+		char *out = realloc(ctx->out, cap);
+		if (out == NULL) {
+			return -1;
+		}
+		ctx->out     = out;
+		ctx->out_cap = cap;
 	}
+	return 0;
+}
 
-	char *buf = malloc(st.st_size + 1); // +1 for null terminator
-	if (buf == NULL) {
-		close(fd);
+int render_context_append(struct render_context *ctx, const char *buf, int len)
+{
+	if (render_context_reserve(ctx, len) == -1) {
 		return -1;
 	}
+	memcpy(ctx->out + ctx->out_len, buf, len);
+	ctx->out_len += len;
+	return 0;
+}
 
-	if (read(fd, buf, st.st_size) == -1) {
-		free(buf);
-		close(fd);
+// Append the utf8 of n cells. The right halves of wide characters are drawn
+// along with their left halves.
+static int render_context_append_cells(struct render_context *ctx, const uint32_t *cells, int n)
+{
+	if (render_context_reserve(ctx, n * 6) == -1) {
 		return -1;
 	}
+	uint8_t *out = (uint8_t *)ctx->out + ctx->out_len;
+	for (int i = 0; i < n; i++) {
+		if (cells[i] == RENDER_CELL_WIDE) {
+			continue;
+		}
+		if (cells[i] < 0x80) {
+			*out++ = cells[i];
+		}
+		else {
+			out += utf8_encode(cells[i], out);
+		}
+	}
+	ctx->out_len = out - (uint8_t *)ctx->out;
+	return 0;
+}
 
-	buf[st.st_size] = 0;
-	close(fd);
+int render_context_append_cursor(struct render_context *ctx, int row, int col)
+{
+	char buf[32] = {};
+	int  buf_len = snprintf(buf, sizeof(buf), "\e[%d;%dH", row + 1, col + 1);
+	return render_context_append(ctx, buf, buf_len);
+}
 
-	file->rope = rope_new();
-	if (rope_insert(file->rope, 0, (uint8_t *)buf) != ROPE_OK) {
-		free(buf);
-		rope_free(file->rope);
-		file->rope = NULL;
-		return -1;
+// Append the SGR sequence which switches the terminal from attribute from to
+// attribute to, changing only what differs.
+int render_context_append_sgr(struct render_context *ctx, uint8_t from, uint8_t to)
+{
+	static const struct {
+		uint8_t flag;
+		int	on;
+		int	off;
+	} styles[] = {
+		{RENDER_ATTR_BOLD, 1, 22},
+		{RENDER_ATTR_UNDERLINE, 4, 24},
+		{RENDER_ATTR_REVERSE, 7, 27},
+	};
+
+	if (from == to) {
+		return 0;
+	}
+	if (to == RENDER_ATTR_NORMAL) {
+		return render_context_append(ctx, "\e[m", 3);
 	}
 
-	free(buf);
-	return 0;
+	char buf[32] = "\e[";
+	int  buf_len = 2;
+	int  fg	     = to & RENDER_ATTR_FG_MASK;
+	if (fg != (from & RENDER_ATTR_FG_MASK)) {
+		buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "%d;", fg == RENDER_COLOR_DEFAULT ? 39 : 29 + fg);
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(styles); i++) {
+		if ((from ^ to) & styles[i].flag) {
+			int code = to & styles[i].flag ? styles[i].on : styles[i].off;
+			buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "%d;", code);
+		}
+	}
+	buf[buf_len - 1] = 'm';
+	return render_context_append(ctx, buf, buf_len);
 }
 
-void file_buffer_reload_str(struct file_buffer *file)
+// Whether a cell with character c and attribute attr looks the same when drawn
+// with the attribute term_attr. The colour and boldness of a space don't show,
+// unless it's in reverse video.
+static bool render_context_looks_same(uint32_t c, uint8_t attr, uint8_t term_attr)
 {
-	file->str_len = rope_byte_count(file->rope);
-	file->str     = realloc(file->str, file->str_len + 1);
-	if (file->str == NULL) {
-		file->str_len = 0;
+	uint8_t hidden = 0;
+	if (c == ' ' && !(attr & RENDER_ATTR_REVERSE)) {
+		hidden = RENDER_ATTR_FG_MASK | RENDER_ATTR_BOLD;
 	}
-	file->str[file->str_len] = 0;
-
-	rope_write_cstr(file->rope, (uint8_t *)file->str);
+	return ((attr ^ term_attr) & ~hidden) == 0;
 }
 
-void file_buffer_render_to_context(struct file_buffer *file, struct render_context *ctx, struct bounds *bounds)
+// Build the output which takes the terminal from the front buffer to the
+// screen buffer in ctx->out.
+static int render_context_diff(struct render_context *ctx, int cursor_row, int cursor_col)
 {
-	int   str_len = rope_byte_count(file->rope);
-	char *str     = (char *)rope_create_cstr(file->rope);
-	int   str_ofs = 0;
+	ctx->out_len = 0;
+	if (render_context_append(ctx, TERMINAL_CURSOR_HIDE) == -1) {
+		return -1;
+	}
 
-	for (int row = 0; row < bounds->height && str_ofs < str_len; row++) {
-		int screen_row = bounds->row + row;
+	// Where the terminal's cursor is after the last run, or -1 if unknown.
+	int term_row = -1;
+	int term_col = -1;
 
-		// Skip rows that are outside the screen bounds
-		if (screen_row < 0 || screen_row >= ctx->rows) {
-			// Still need to advance through the string for this row
-			while (str_ofs < str_len && str[str_ofs] != '\n') {
-				str_ofs++;
-			}
-			if (str_ofs < str_len && str[str_ofs] == '\n') {
-				str_ofs++; // consume newline
-			}
+	// Every frame leaves the terminal drawing with RENDER_ATTR_NORMAL, so plain
+	// text never needs an SGR sequence.
+	uint8_t term_attr = RENDER_ATTR_NORMAL;
+
+	for (int row = 0; row < ctx->rows; row++) {
+		uint32_t *back	      = ctx->screen_buffer + row * ctx->cols;
+		uint32_t *front	      = ctx->front_buffer + row * ctx->cols;
+		uint8_t	 *back_attrs  = ctx->attr_buffer + row * ctx->cols;
+		uint8_t	 *front_attrs = ctx->front_attrs + row * ctx->cols;
+
+		if (ctx->front_valid && memcmp(back, front, ctx->cols * sizeof(*back)) == 0 &&
+		    memcmp(back_attrs, front_attrs, ctx->cols) == 0) {
 			continue;
 		}
 
-		bool found_newline = false;
-		for (int col = 0; col < bounds->width && str_ofs < str_len; col++) {
-			int screen_col = bounds->col + col;
+		int col = 0;
+		while (col < ctx->cols) {
+			if (ctx->front_valid && back[col] == front[col] && back_attrs[col] == front_attrs[col]) {
+				col++;
+				continue;
+			}
 
-			// Skip columns that are outside the screen bounds
-			if (screen_col < 0 || screen_col >= ctx->cols) {
-				if (!found_newline) {
-					char c = str[str_ofs];
-					if (c == '\n') {
-						found_newline = true;
-					}
-					str_ofs++;
+			// Extend the run over further changes, bridging short unchanged gaps.
+			int run_end = col + 1;
+			for (int i = run_end; i < ctx->cols && i - run_end < RENDER_CONTEXT_MAX_GAP; i++) {
+				if (!ctx->front_valid || back[i] != front[i] || back_attrs[i] != front_attrs[i]) {
+					run_end = i + 1;
 				}
-				continue;
 			}
 
-			if (!found_newline) {
-				char c = str[str_ofs];
-				if (c == '\n') {
-					found_newline = true;
-					str_ofs++; // consume the newline
-						   // rest of row in bounds will be whatever was already in
-						   // screen_buffer
+			// A wide character is always written whole.
+			if (col > 0 && back[col] == RENDER_CELL_WIDE) {
+				col--;
+			}
+			if (run_end < ctx->cols && back[run_end] == RENDER_CELL_WIDE) {
+				run_end++;
+			}
+
+			if (term_row != row || term_col != col) {
+				if (render_context_append_cursor(ctx, row, col) == -1) {
+					return -1;
 				}
-				else {
-					int screen_idx		       = screen_row * ctx->cols + screen_col;
-					ctx->screen_buffer[screen_idx] = c;
-					str_ofs++;
+			}
+
+			// Write the run in pieces which look the same in one attribute,
+			// switching the terminal's attribute only between them.
+			for (int i = col; i < run_end;) {
+				if (!render_context_looks_same(back[i], back_attrs[i], term_attr)) {
+					if (render_context_append_sgr(ctx, term_attr, back_attrs[i]) == -1) {
+						return -1;
+					}
+					term_attr = back_attrs[i];
+				}
+
+				int end = i + 1;
+				while (end < run_end && render_context_looks_same(back[end], back_attrs[end], term_attr)) {
+					end++;
+				}
+				if (render_context_append_cells(ctx, back + i, end - i) == -1) {
+					return -1;
 				}
+				i = end;
 			}
-			// if found_newline is true, we leave whatever was already in screen_buffer
+
+			// Writing the last column leaves the terminal in a pending wrap state,
+			// so don't rely on where the cursor ends up after it.
+			term_row = row;
+			term_col = run_end < ctx->cols ? run_end : -1;
+			col	 = run_end;
 		}
 	}
 
-	free(str);
+	if (term_attr != RENDER_ATTR_NORMAL && render_context_append_sgr(ctx, term_attr, RENDER_ATTR_NORMAL) == -1) {
+		return -1;
+	}
+	if (render_context_append_cursor(ctx, cursor_row, cursor_col) == -1) {
+		return -1;
+	}
+	return render_context_append(ctx, TERMINAL_CURSOR_SHOW);
 }
 
-void file_buffer_update_cursor_coords(struct file_buffer *file, struct bounds *bounds)
+// Write all of ctx->out to fd, which may take more than one write.
+static int render_context_write(struct render_context *ctx, int fd)
 {
-	file->cursor_row = 0;
-	file->cursor_col = 0;
-
-	if (file->cursor_pos > file->str_len) {
-		return;
-	}
-
-	for (int i = 0; i < file->cursor_pos; i++) {
-		file->cursor_col++;
-		if (file->str[i] == '\n' || file->cursor_col % bounds->width == 0) {
-			file->cursor_row++;
-			file->cursor_col = 0;
+	for (int written = 0; written < ctx->out_len;) {
+		ssize_t n = write(fd, ctx->out + written, ctx->out_len - written);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
 		}
+		written += n;
 	}
+	return 0;
 }
-void file_buffer_move_cursor_prev_line(struct file_buffer *file, struct bounds *bounds)
+
+int render_context_render(struct render_context *ctx, int fd, int cursor_row, int cursor_col)
 {
-	// If we're at the beginning of the buffer, nothing to do
-	if (file->cursor_pos == 0) {
-		return;
+	if (render_context_diff(ctx, cursor_row, cursor_col) == -1 || render_context_write(ctx, fd) == -1) {
+		// The terminal may have been left with part of a frame, so the next one
+		// is drawn in full.
+		ctx->front_valid = false;
+		return -1;
 	}
 
-	// Find the start of the current line
-	char *current_line_start = file->str + file->cursor_pos;
-	while (current_line_start > file->str && *(current_line_start - 1) != '\n') {
-		current_line_start--;
-	}
+	memcpy(ctx->front_buffer, ctx->screen_buffer, ctx->rows * ctx->cols * sizeof(*ctx->front_buffer));
+	memcpy(ctx->front_attrs, ctx->attr_buffer, ctx->rows * ctx->cols);
+	ctx->front_valid = true;
+	ctx->frame_bytes = ctx->out_len;
+	return ctx->frame_bytes;
+}
 
-	// If we're already at the first line, nothing to do
-	if (current_line_start == file->str) {
-		return;
+void render_context_cleanup(struct render_context *ctx)
+{
+	if (ctx->screen_buffer != NULL) {
+		free(ctx->screen_buffer);
+		ctx->screen_buffer = NULL;
 	}
-
-	// Find the start of the previous line
-	char *prev_line_start = current_line_start - 1; // Start from the '\n' before current line
-	while (prev_line_start > file->str && *(prev_line_start - 1) != '\n') {
-		prev_line_start--;
+	if (ctx->attr_buffer != NULL) {
+		free(ctx->attr_buffer);
+		ctx->attr_buffer = NULL;
+	}
+	if (ctx->front_buffer != NULL) {
+		free(ctx->front_buffer);
+		ctx->front_buffer = NULL;
 	}
+	if (ctx->front_attrs != NULL) {
+		free(ctx->front_attrs);
+		ctx->front_attrs = NULL;
+	}
+	if (ctx->out != NULL) {
+		free(ctx->out);
+		ctx->out = NULL;
+	}
+}
 
-	// Calculate the length of the previous line
-	int prev_line_len = (current_line_start - 1) - prev_line_start;
+// The most bytes of edits the undo history of a file keeps. The oldest undo
+// units are dropped to stay under it.
+#ifndef UNDO_HISTORY_LIMIT
+#define UNDO_HISTORY_LIMIT (16 * 1024 * 1024)
+#endif
 
-	// Place cursor at the minimum of desired column and line length
-	int offset	 = (file->cursor_col < prev_line_len) ? file->cursor_col : prev_line_len;
-	file->cursor_pos = (prev_line_start - file->str) + offset;
+// One edit in the undo history: at pos, the deleted text was replaced by the
+// inserted text. In the arena each record is followed by the inserted bytes
+// and then the deleted bytes.
+struct undo_record {
+	size_t pos;
+	size_t inserted_len;
+	size_t inserted_chars;
+	size_t deleted_len;
+	size_t deleted_chars;
 
-	file_buffer_update_cursor_coords(file, bounds);
-}
+	// The size of the record before this one in the arena, so the history can
+	// be walked backwards.
+	size_t prev_size;
 
-void file_buffer_move_cursor_next_line(struct file_buffer *file, struct bounds *bounds)
+	// Whether this is the first record of an undo unit. Undo and redo always
+	// step over whole units.
+	bool group_start;
+};
+
+// The undo history of a file, as a log of the edits made to it. Records are
+// appended to a single arena and referred to by their offset in it.
+struct undo_history {
+	char  *arena;
+	size_t arena_size;
+	size_t limit;
+
+	// The records in use are between start and end. Those before top have been
+	// applied to the file, and those after it have been undone and can be redone.
+	size_t start;
+	size_t top;
+	size_t end;
+
+	// The offset of the last record before top. Only valid if top > start.
+	size_t last;
+
+	// Whether the next edit may be added to the last undo unit.
+	bool group_open;
+};
+
+#define UNDO_RECORD_ALIGN 8
+
+void undo_history_init(struct undo_history *h, size_t limit);
+void undo_history_insert(struct undo_history *h, size_t pos, const char *str, size_t len, size_t num_chars);
+void undo_history_delete(struct undo_history *h, size_t pos, const char *str, size_t len, size_t num_chars);
+void undo_history_break(struct undo_history *h);
+void undo_history_cleanup(struct undo_history *h);
+
+static size_t undo_record_size(size_t inserted_len, size_t deleted_len)
 {
-	// Find the next newline
-	char *next_nl = memchr(file->str + file->cursor_pos, '\n', file->str_len - file->cursor_pos);
-	if (next_nl == NULL) {
-		return;
-	}
+	size_t size = sizeof(struct undo_record) + inserted_len + deleted_len;
+	return (size + UNDO_RECORD_ALIGN - 1) & ~(size_t)(UNDO_RECORD_ALIGN - 1);
+}
 
-	// Move to start of next line
-	int next_line_start = next_nl - file->str + 1;
+static char *undo_record_inserted(struct undo_record *rec) { return (char *)(rec + 1); }
+static char *undo_record_deleted(struct undo_record *rec) { return (char *)(rec + 1) + rec->inserted_len; }
 
-	// Find the end of the next line (or end of buffer)
-	char *line_end	    = memchr(file->str + next_line_start, '\n', file->str_len - next_line_start);
-	int   next_line_len = line_end ? (line_end - (file->str + next_line_start)) : (file->str_len - next_line_start);
+static struct undo_record *undo_history_at(struct undo_history *h, size_t ofs)
+{
+	return (struct undo_record *)&h->arena[ofs];
+}
 
-	// Place cursor at the minimum of desired column and line length
-	int offset	 = (file->cursor_col < next_line_len) ? file->cursor_col : next_line_len;
-	file->cursor_pos = next_line_start + offset;
+void undo_history_init(struct undo_history *h, size_t limit)
+{
+	h->arena      = NULL;
+	h->arena_size = 0;
+	h->limit      = limit;
+	h->start = h->top = h->end = h->last = 0;
+	h->group_open			     = false;
+}
 
-	file_buffer_update_cursor_coords(file, bounds);
+// Forget everything. This is also what happens if the history can't grow, or
+// a single edit is over the limit.
+static void undo_history_clear(struct undo_history *h)
+{
+	free(h->arena);
+	h->arena      = NULL;
+	h->arena_size = 0;
+	h->start = h->top = h->end = h->last = 0;
+	h->group_open			     = false;
 }
 
-void file_buffer_insert(struct file_buffer *file, char c)
+// Make room for size more bytes at the end of the arena.
+static int undo_history_reserve(struct undo_history *h, size_t size)
 {
-	char str[2] = {c, 0};
-	rope_insert(file->rope, file->cursor_pos, (uint8_t *)str);
-	file->cursor_pos++;
+	if (h->end + size <= h->arena_size) {
+		return 0;
+	}
+
+	size_t new_size = MAX(h->arena_size * 2, h->end + size);
+	char  *arena	= realloc(h->arena, new_size);
+	if (arena == NULL) {
+		return -1;
+	}
+	h->arena      = arena;
+	h->arena_size = new_size;
+	return 0;
 }
 
-void file_buffer_delete(struct file_buffer *file)
+// Drop the oldest undo units until the history fits in its limit. The space
+// they took up is reclaimed by moving the rest down once it's worth it.
+static void undo_history_trim(struct undo_history *h)
 {
+	while (h->end - h->start > h->limit && h->start < h->top) {
+		size_t ofs = h->start;
+		do {
+			struct undo_record *rec = undo_history_at(h, ofs);
+			ofs += undo_record_size(rec->inserted_len, rec->deleted_len);
+		} while (ofs < h->top && !undo_history_at(h, ofs)->group_start);
+		h->start = ofs;
+	}
 
-	file->cursor_pos--;
-	rope_del(file->rope, file->cursor_pos, 1);
+	if (h->start == h->end) {
+		// Even the last unit didn't fit.
+		undo_history_clear(h);
+		return;
+	}
+	if (h->start >= h->end - h->start) {
+		memmove(h->arena, &h->arena[h->start], h->end - h->start);
+		h->top -= h->start;
+		h->end -= h->start;
+		h->last -= h->start;
+		h->start = 0;
+	}
 }
 
-void file_buffer_cleanup(struct file_buffer *file)
+// Start a new record for an edit at pos. Any undone records are dropped, since
+// they can't be redone after a new edit.
+static struct undo_record *undo_history_push(struct undo_history *h, size_t pos, size_t inserted_len,
+					     size_t deleted_len)
 {
-	if (file->rope != NULL) {
-		rope_free(file->rope);
+	h->end	    = h->top;
+	size_t size = undo_record_size(inserted_len, deleted_len);
+	if (undo_history_reserve(h, size) == -1) {
+		undo_history_clear(h);
+		return NULL;
 	}
+
+	struct undo_record *rec = undo_history_at(h, h->end);
+	rec->pos		= pos;
+	rec->inserted_len	= inserted_len;
+	rec->inserted_chars	= 0;
+	rec->deleted_len	= deleted_len;
+	rec->deleted_chars	= 0;
+	rec->prev_size		= h->top > h->start ? h->top - h->last : 0;
+	rec->group_start	= !h->group_open;
+
+	h->last	      = h->end;
+	h->top	      = h->end + size;
+	h->end	      = h->top;
+	h->group_open = true;
+	return rec;
 }
 
-struct status_line {
-	char *mode;
-	int   mode_len;
-	char *file;
-	int   file_len;
-	int   cursor_row;
-	int   cursor_col;
-};
+// Get the last record if the next edit could be merged into it.
+static struct undo_record *undo_history_open_record(struct undo_history *h)
+{
+	if (!h->group_open || h->top == h->start || h->top != h->end) {
+		return NULL;
+	}
+	return undo_history_at(h, h->last);
+}
 
-void status_line_render_to_context(struct status_line *sl, struct render_context *ctx, struct bounds *bounds)
+// Resize the last record to hold the given amount of text.
+static struct undo_record *undo_history_resize_last(struct undo_history *h, size_t inserted_len, size_t deleted_len)
 {
-	// Only render if we have at least one row in the bounds
-	if (bounds->height < 1) {
-		return;
+	h->end = h->last;
+	if (undo_history_reserve(h, undo_record_size(inserted_len, deleted_len)) == -1) {
+		undo_history_clear(h);
+		return NULL;
 	}
+	h->end = h->top = h->last + undo_record_size(inserted_len, deleted_len);
+	return undo_history_at(h, h->last);
+}
 
-	int screen_row = bounds->row;
+// Record that len bytes (num_chars characters) of text were inserted at pos.
+// Typing is merged into the record before it. If the history runs out of
+// memory it is cleared instead.
+void undo_history_insert(struct undo_history *h, size_t pos, const char *str, size_t len, size_t num_chars)
+{
+	struct undo_record *rec = undo_history_open_record(h);
+	size_t		    ofs = 0;
 
-	// Skip if the status line row is outside screen bounds
-	if (screen_row < 0 || screen_row >= ctx->rows) {
+	if (rec != NULL && rec->deleted_len == 0 && pos == rec->pos + rec->inserted_chars) {
+		ofs = rec->inserted_len;
+		rec = undo_history_resize_last(h, rec->inserted_len + len, 0);
+	}
+	else {
+		rec = undo_history_push(h, pos, len, 0);
+	}
+	if (rec == NULL) {
 		return;
 	}
 
-	int offset = 0;
+	memcpy(&undo_record_inserted(rec)[ofs], str, len);
+	rec->inserted_len = ofs + len;
+	rec->inserted_chars += num_chars;
+	undo_history_trim(h);
+}
+
+// Record that the len bytes (num_chars characters) of text at str were deleted
+// from pos. Backspacing over text which was just typed takes it back out of the
+// record it was typed into, and further backspacing is merged into one record.
+// If the history runs out of memory it is cleared instead.
+void undo_history_delete(struct undo_history *h, size_t pos, const char *str, size_t len, size_t num_chars)
+{
+	struct undo_record *rec = undo_history_open_record(h);
 
-	// Render mode
-	for (int i = 0; i < sl->mode_len && offset < bounds->width; i++) {
-		int screen_col = bounds->col + offset;
-		if (screen_col >= 0 && screen_col < ctx->cols) {
-			int screen_idx		       = screen_row * ctx->cols + screen_col;
-			ctx->screen_buffer[screen_idx] = sl->mode[i];
+	if (rec != NULL && rec->deleted_len == 0 && pos >= rec->pos &&
+	    pos + num_chars == rec->pos + rec->inserted_chars) {
+		rec->inserted_chars -= num_chars;
+		rec->inserted_len -= len;
+		if (rec->inserted_chars > 0) {
+			undo_history_resize_last(h, rec->inserted_len, 0);
+			return;
 		}
-		offset++;
-	}
 
-	// Space between mode and filename (4 spaces)
-	offset += 4;
+		// Nothing is left of the record.
+		h->group_open = !rec->group_start;
+		h->end = h->top = h->last;
+		h->last -= rec->prev_size;
+		return;
+	}
 
-	// Render filename
-	for (int i = 0; i < sl->file_len && offset < bounds->width; i++) {
-		int screen_col = bounds->col + offset;
-		if (screen_col >= 0 && screen_col < ctx->cols) {
-			int screen_idx		       = screen_row * ctx->cols + screen_col;
-			ctx->screen_buffer[screen_idx] = sl->file[i];
+	if (rec != NULL && rec->inserted_len == 0 && pos + num_chars == rec->pos) {
+		size_t deleted_len = rec->deleted_len;
+		rec		   = undo_history_resize_last(h, 0, deleted_len + len);
+		if (rec == NULL) {
+			return;
+		}
+		memmove(&undo_record_deleted(rec)[len], undo_record_deleted(rec), deleted_len);
+		rec->deleted_len = deleted_len + len;
+	}
+	else {
+		rec = undo_history_push(h, pos, 0, len);
+		if (rec == NULL) {
+			return;
 		}
-		offset++;
 	}
 
-	// Prepare cursor position string
-	char str[32] = {};
-	int  str_len = snprintf(str, sizeof(str), "%d,%d", sl->cursor_row, sl->cursor_col);
+	memcpy(undo_record_deleted(rec), str, len);
+	rec->pos = pos;
+	rec->deleted_chars += num_chars;
+	undo_history_trim(h);
+}
 
-	// Right align cursor position within the bounds
-	offset = bounds->width - str_len;
-	if (offset < 0) {
-		offset = 0;
+// End the current undo unit. The next edit starts a new one.
+void undo_history_break(struct undo_history *h) { h->group_open = false; }
+
+// Step back over the last applied record and return it, or NULL if there's
+// nothing to undo.
+static struct undo_record *undo_history_step_back(struct undo_history *h)
+{
+	if (h->top == h->start) {
+		return NULL;
 	}
+	struct undo_record *rec = undo_history_at(h, h->last);
+	h->top			= h->last;
+	h->last -= rec->prev_size;
+	return rec;
+}
 
-	// Render cursor position
-	for (int i = 0; i < str_len && offset < bounds->width; i++) {
-		int screen_col = bounds->col + offset;
-		if (screen_col >= 0 && screen_col < ctx->cols) {
-			int screen_idx		       = screen_row * ctx->cols + screen_col;
-			ctx->screen_buffer[screen_idx] = str[i];
-		}
-		offset++;
+// Step forward over the next undone record and return it, or NULL if there's
+// nothing to redo.
+static struct undo_record *undo_history_step_forward(struct undo_history *h)
+{
+	if (h->top == h->end) {
+		return NULL;
 	}
+	struct undo_record *rec = undo_history_at(h, h->top);
+	h->last			= h->top;
+	h->top += undo_record_size(rec->inserted_len, rec->deleted_len);
+	return rec;
 }
 
-int main(void)
+// Whether the next record to redo starts a new undo unit.
+static bool undo_history_at_group_start(struct undo_history *h)
 {
-	struct terminal_config term	    = {};
-	struct render_context  render_ctx   = {};
-	struct file_buffer     file_buffer  = {};
-	struct editor_state    editor_state = {.mode = EDITOR_MODE_NORMAL};
+	return h->top == h->end || undo_history_at(h, h->top)->group_start;
+}
 
-	if (terminal_init(&term) == -1) {
-		err(EXIT_FAILURE, "terminal init");
-	}
+void undo_history_cleanup(struct undo_history *h)
+{
+	free(h->arena);
+	h->arena = NULL;
+}
 
-	if (render_context_init(&render_ctx, term.window_rows, term.window_cols) == -1) {
-		terminal_cleanup(&term);
-		err(EXIT_FAILURE, "render context init");
-	}
+// Lines longer than this aren't highlighted, and the line after one starts in
+// the same state as it did.
+#ifndef HIGHLIGHT_LINE_MAX
+#define HIGHLIGHT_LINE_MAX (64 * 1024)
+#endif
 
-	if (file_buffer_init_from_file(&file_buffer, "dummyfile.txt") == -1) {
-		render_context_cleanup(&render_ctx);
-		terminal_cleanup(&term);
-		err(EXIT_FAILURE, "file buffer init");
-	}
+// The attribute each kind of token is drawn with.
+#define HIGHLIGHT_KEYWORD RENDER_COLOR_MAGENTA
+#define HIGHLIGHT_TYPE	  RENDER_COLOR_GREEN
+#define HIGHLIGHT_STRING  RENDER_COLOR_YELLOW
+#define HIGHLIGHT_NUMBER  RENDER_COLOR_CYAN
+#define HIGHLIGHT_COMMENT RENDER_COLOR_BLUE
+#define HIGHLIGHT_PREPROC RENDER_COLOR_RED
 
-	struct bounds file_buffer_bounds;
-	file_buffer_bounds.col	  = 0;
-	file_buffer_bounds.row	  = 0;
-	file_buffer_bounds.width  = term.window_cols;
-	file_buffer_bounds.height = term.window_rows - 2;
+// What the C lexer is in the middle of at the start of a line.
+enum highlight_state {
+	HIGHLIGHT_STATE_NORMAL,
+	HIGHLIGHT_STATE_COMMENT,
+};
 
-	struct bounds status_line_bounds;
-	status_line_bounds.col	  = 0;
-	status_line_bounds.row	  = term.window_rows - 2;
-	status_line_bounds.width  = term.window_cols;
-	status_line_bounds.height = 1;
+// Syntax highlighting of C source. The lexer's state at the start of each line
+// is cached, so an edit only costs lexing the lines after it until one starts
+// in the same state as before, as every line from there on lexes the same.
+// Lines are only lexed as far as has been drawn.
+struct highlight {
+	bool enabled;
 
-	struct status_line status_line;
-	status_line.mode       = "NORMAL";
-	status_line.mode_len   = 6;
-	status_line.file       = "foo.c";
-	status_line.file_len   = 5;
-	status_line.cursor_row = 10;
-	status_line.cursor_col = 50;
+	uint8_t *states; // The highlight_state each line starts in
+	size_t	 states_size;
 
-	render_context_clear(&render_ctx);
-	file_buffer_reload_str(&file_buffer);
-	file_buffer_render_to_context(&file_buffer, &render_ctx, &file_buffer_bounds);
-	status_line_render_to_context(&status_line, &render_ctx, &status_line_bounds);
-	render_context_render(&render_ctx, term.fd, 0, 0);
+	// states is right for the lines before frontier. The lines from frontier up
+	// to lexed have been lexed, but may be out of date. Those from dirty_end on
+	// were lexed in one go and haven't been edited since, so once a line there
+	// starts in the state it's cached with, all the lines up to lexed are right.
+	size_t frontier;
+	size_t lexed;
+	size_t dirty_end;
 
-	for (;;) {
+	// The line being lexed, and the attribute of each of its bytes.
+	uint8_t *line;
+	uint8_t *attrs;
+};
 
-		char c;
-		if (read(term.fd, &c, 1) == -1) {
-			err(EXIT_FAILURE, "read input");
-		}
+// Keywords and types, sorted for a binary search.
+static const struct highlight_word {
+	const char *word;
+	uint8_t	    attr;
+} highlight_words[] = {
+	{"bool", HIGHLIGHT_TYPE},
+	{"break", HIGHLIGHT_KEYWORD},
+	{"case", HIGHLIGHT_KEYWORD},
+	{"char", HIGHLIGHT_TYPE},
+	{"const", HIGHLIGHT_KEYWORD},
+	{"continue", HIGHLIGHT_KEYWORD},
+	{"default", HIGHLIGHT_KEYWORD},
+	{"do", HIGHLIGHT_KEYWORD},
+	{"double", HIGHLIGHT_TYPE},
+	{"else", HIGHLIGHT_KEYWORD},
+	{"enum", HIGHLIGHT_KEYWORD},
+	{"extern", HIGHLIGHT_KEYWORD},
+	{"float", HIGHLIGHT_TYPE},
+	{"for", HIGHLIGHT_KEYWORD},
+	{"goto", HIGHLIGHT_KEYWORD},
+	{"if", HIGHLIGHT_KEYWORD},
+	{"inline", HIGHLIGHT_KEYWORD},
+	{"int", HIGHLIGHT_TYPE},
+	{"int16_t", HIGHLIGHT_TYPE},
+	{"int32_t", HIGHLIGHT_TYPE},
+	{"int64_t", HIGHLIGHT_TYPE},
+	{"int8_t", HIGHLIGHT_TYPE},
+	{"long", HIGHLIGHT_TYPE},
+	{"off_t", HIGHLIGHT_TYPE},
+	{"register", HIGHLIGHT_KEYWORD},
+	{"restrict", HIGHLIGHT_KEYWORD},
+	{"return", HIGHLIGHT_KEYWORD},
+	{"short", HIGHLIGHT_TYPE},
+	{"signed", HIGHLIGHT_TYPE},
+	{"size_t", HIGHLIGHT_TYPE},
+	{"sizeof", HIGHLIGHT_KEYWORD},
+	{"ssize_t", HIGHLIGHT_TYPE},
+	{"static", HIGHLIGHT_KEYWORD},
+	{"struct", HIGHLIGHT_KEYWORD},
+	{"switch", HIGHLIGHT_KEYWORD},
+	{"typedef", HIGHLIGHT_KEYWORD},
+	{"uint16_t", HIGHLIGHT_TYPE},
+	{"uint32_t", HIGHLIGHT_TYPE},
+	{"uint64_t", HIGHLIGHT_TYPE},
+	{"uint8_t", HIGHLIGHT_TYPE},
+	{"union", HIGHLIGHT_KEYWORD},
+	{"unsigned", HIGHLIGHT_TYPE},
+	{"void", HIGHLIGHT_TYPE},
+	{"volatile", HIGHLIGHT_KEYWORD},
+	{"while", HIGHLIGHT_KEYWORD},
+};
 
-		debug("keypress: %d\n", c);
+// The length of the longest word in highlight_words.
+#define HIGHLIGHT_WORD_MAX 8
 
-		bool should_exit = false;
+static uint8_t highlight_word_attr(const uint8_t *word, size_t len)
+{
+	if (len > HIGHLIGHT_WORD_MAX) {
+		return RENDER_ATTR_NORMAL;
+	}
 
-		if (editor_state.mode == EDITOR_MODE_NORMAL) {
-			switch (c) {
-			case 'h':
-				file_buffer.cursor_pos--;
-				file_buffer_update_cursor_coords(&file_buffer, &file_buffer_bounds);
-				terminal_place_cursor(&term, file_buffer.cursor_row, file_buffer.cursor_col);
-				break;
-			case 'j':
-				file_buffer_move_cursor_next_line(&file_buffer, &file_buffer_bounds);
-				terminal_place_cursor(&term, file_buffer.cursor_row, file_buffer.cursor_col);
-				break;
-			case 'k':
-				file_buffer_move_cursor_prev_line(&file_buffer, &file_buffer_bounds);
-				terminal_place_cursor(&term, file_buffer.cursor_row, file_buffer.cursor_col);
-				break;
-			case 'l':
-				file_buffer.cursor_pos++;
-				file_buffer_update_cursor_coords(&file_buffer, &file_buffer_bounds);
-				terminal_place_cursor(&term, file_buffer.cursor_row, file_buffer.cursor_col);
-				break;
-			case 'i':
-				editor_state.mode = EDITOR_MODE_INSERT;
-				write(term.fd, TERMINAL_CURSOR_BAR);
-				break;
-			case 'q':
-				should_exit = true;
-				break;
-			}
+	size_t lo = 0;
+	size_t hi = ARRAY_SIZE(highlight_words);
+	while (lo < hi) {
+		size_t	    mid = lo + (hi - lo) / 2;
+		const char *w	= highlight_words[mid].word;
+
+		size_t i = 0;
+		while (i < len && w[i] == word[i]) {
+			i++;
+		}
+		int cmp = i < len ? (uint8_t)w[i] - word[i] : w[len] != '\0';
+		if (cmp == 0) {
+			return highlight_words[mid].attr;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
 		}
 		else {
-			switch (c) {
-			case '\e':
-				editor_state.mode = EDITOR_MODE_NORMAL;
-				write(term.fd, TERMINAL_CURSOR_BLOCK);
-				break;
-			case 127:
-				file_buffer_delete(&file_buffer);
-				break;
-			default:
-				file_buffer_insert(&file_buffer, c);
+			hi = mid;
+		}
+	}
+	return RENDER_ATTR_NORMAL;
+}
+
+static bool highlight_is_digit(uint8_t c) { return (unsigned)(c - '0') < 10; }
+
+static bool highlight_is_word(uint8_t c)
+{
+	return (unsigned)((c | 0x20) - 'a') < 26 || highlight_is_digit(c) || c == '_';
+}
+
+// Find the end of a block comment in the len bytes at str. Returns false if
+// it doesn't end there.
+static bool highlight_comment_end(const uint8_t *str, size_t len, size_t *end)
+{
+	for (size_t i = 1; i < len; i++) {
+		if (str[i] == '/' && str[i - 1] == '*') {
+			*end = i + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Lex the len bytes of a line which starts in state, setting the attribute of
+// each of its bytes in attrs. Returns the state the next line starts in.
+static enum highlight_state highlight_lex_line(const uint8_t *line, size_t len, enum highlight_state state,
+					       uint8_t *attrs)
+{
+	size_t i = 0;
+	if (state == HIGHLIGHT_STATE_COMMENT) {
+		if (!highlight_comment_end(line, len, &i)) {
+			memset(attrs, HIGHLIGHT_COMMENT, len);
+			return HIGHLIGHT_STATE_COMMENT;
+		}
+		memset(attrs, HIGHLIGHT_COMMENT, i);
+	}
+
+	bool line_start = i == 0;
+	while (i < len) {
+		uint8_t c     = line[i];
+		size_t	start = i++;
+		uint8_t attr  = RENDER_ATTR_NORMAL;
+
+		if (c == '/' && i < len && line[i] == '/') {
+			i    = len;
+			attr = HIGHLIGHT_COMMENT;
+		}
+		else if (c == '/' && i < len && line[i] == '*') {
+			size_t end;
+			if (!highlight_comment_end(line + i + 1, len - i - 1, &end)) {
+				memset(attrs + start, HIGHLIGHT_COMMENT, len - start);
+				return HIGHLIGHT_STATE_COMMENT;
+			}
+			i    = i + 1 + end;
+			attr = HIGHLIGHT_COMMENT;
+		}
+		else if (c == '"' || c == '\'') {
+			while (i < len && line[i] != c) {
+				i += line[i] == '\\' ? 2 : 1;
+			}
+			i    = MIN(i + 1, len);
+			attr = HIGHLIGHT_STRING;
+		}
+		else if (c == '#' && line_start) {
+			while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+				i++;
+			}
+			while (i < len && highlight_is_word(line[i])) {
+				i++;
+			}
+			attr = HIGHLIGHT_PREPROC;
+		}
+		else if (highlight_is_digit(c)) {
+			while (i < len && (highlight_is_word(line[i]) || line[i] == '.')) {
+				i++;
+			}
+			attr = HIGHLIGHT_NUMBER;
+		}
+		else if (highlight_is_word(c)) {
+			while (i < len && highlight_is_word(line[i])) {
+				i++;
+			}
+			attr = highlight_word_attr(line + start, i - start);
+		}
+
+		if (i - start == 1) {
+			attrs[start] = attr;
+		}
+		else {
+			memset(attrs + start, attr, i - start);
+		}
+		if (c != ' ' && c != '\t') {
+			line_start = false;
+		}
+	}
+	return HIGHLIGHT_STATE_NORMAL;
+}
+
+// Only C source is highlighted, going by pathname's extension.
+void highlight_init(struct highlight *h, const char *pathname)
+{
+	static const char *const extensions[] = {".c", ".h", ".cc", ".cpp", ".hpp"};
+
+	memset(h, 0, sizeof(*h));
+	const char *ext = strrchr(pathname, '.');
+	for (size_t i = 0; ext != NULL && i < ARRAY_SIZE(extensions); i++) {
+		if (strcmp(ext, extensions[i]) == 0) {
+			h->enabled = true;
+		}
+	}
+}
+
+void highlight_cleanup(struct highlight *h)
+{
+	free(h->states);
+	free(h->line);
+	free(h->attrs);
+	memset(h, 0, sizeof(*h));
+}
+
+// Make room for the states of num_lines lines. Highlighting is turned off if
+// there's no memory for it.
+static bool highlight_reserve(struct highlight *h, size_t num_lines)
+{
+	if (num_lines <= h->states_size) {
+		return true;
+	}
+	size_t	 size  = MAX(num_lines, h->states_size * 2);
+	uint8_t *grown = realloc(h->states, size);
+	if (grown == NULL) {
+		highlight_cleanup(h);
+		return false;
+	}
+	h->states      = grown;
+	h->states_size = size;
+	return true;
+}
+
+static size_t count_newlines(const char *str, size_t len)
+{
+	size_t	    n	= 0;
+	const char *end = str + len;
+	while ((str = memchr(str, '\n', end - str)) != NULL) {
+		n++;
+		str++;
+	}
+	return n;
+}
+
+// Account for an edit starting on line which replaced removed newlines with
+// added ones. The states of the lines after the edit are kept, moved along with
+// their lines, as they're likely to still be right.
+void highlight_edit(struct highlight *h, size_t line, size_t removed, size_t added)
+{
+	if (!h->enabled) {
+		return;
+	}
+
+	// The state line starts in doesn't depend on line itself, but the ones
+	// after it do.
+	size_t old_end = line + 1 + removed;
+	size_t new_end = line + 1 + added;
+	h->frontier    = MIN(h->frontier, line + 1);
+	if (old_end >= h->lexed) {
+		h->lexed = MIN(h->lexed, line + 1);
+		return;
+	}
+
+	size_t num_kept = h->lexed - old_end;
+	if (new_end != old_end) {
+		if (!highlight_reserve(h, new_end + num_kept)) {
+			return;
+		}
+		memmove(h->states + new_end, h->states + old_end, num_kept);
+		h->lexed = new_end + num_kept;
+	}
+
+	if (h->dirty_end >= old_end) {
+		h->dirty_end = h->dirty_end - old_end + new_end;
+	}
+	h->dirty_end = MAX(h->dirty_end, new_end);
+}
+
+// Copy up to max bytes of the line at *node and *ofs into buf, and move past
+// its newline. Returns the number of bytes copied.
+static size_t highlight_copy_line(rope_node **node, size_t *ofs, uint8_t *buf, size_t max)
+{
+	size_t len = 0;
+	for (; *node != NULL; *node = rope_node_next(*node), *ofs = 0) {
+		const uint8_t *data = rope_node_data(*node) + *ofs;
+		size_t	       n    = rope_node_num_bytes(*node) - *ofs;
+		const uint8_t *nl   = memchr(data, '\n', n);
+		if (nl != NULL) {
+			n = nl - data;
+		}
+
+		size_t copied = MIN(n, max - len);
+		memcpy(buf + len, data, copied);
+		len += copied;
+		if (nl != NULL) {
+			*ofs += n + 1;
+			break;
+		}
+	}
+	return len;
+}
+
+// Lex the line at *node and *ofs into h->line and h->attrs, and move past it.
+// Returns its length, or 0 if it's too long to be highlighted.
+static size_t highlight_lex(struct highlight *h, rope_node **node, size_t *ofs, enum highlight_state *state)
+{
+	size_t len = highlight_copy_line(node, ofs, h->line, HIGHLIGHT_LINE_MAX + 1);
+	if (len > HIGHLIGHT_LINE_MAX) {
+		return 0;
+	}
+	*state = highlight_lex_line(h->line, len, *state, h->attrs);
+	return len;
+}
+
+// Bring the states of the lines up to and including line up to date, lexing
+// onwards from the frontier.
+static bool highlight_update(struct highlight *h, rope *r, size_t line)
+{
+	if (h->line == NULL) {
+		h->line	 = malloc(HIGHLIGHT_LINE_MAX + 1);
+		h->attrs = malloc(HIGHLIGHT_LINE_MAX + 1);
+		if (h->line == NULL || h->attrs == NULL || !highlight_reserve(h, 1)) {
+			highlight_cleanup(h);
+			return false;
+		}
+		h->states[0] = HIGHLIGHT_STATE_NORMAL;
+		h->frontier  = 1;
+		h->lexed     = 1;
+	}
+	if (!highlight_reserve(h, line + 1)) {
+		return false;
+	}
+
+	// Lines are lexed one after another by walking the rope's nodes, which only
+	// need looking up again after jumping ahead to where lexing converged.
+	rope_node *node = NULL;
+	size_t	   ofs	= 0;
+	while (h->frontier <= line) {
+		size_t next = h->frontier;
+		if (node == NULL) {
+			node = rope_node_at(r, rope_line_to_char(r, next - 1), &ofs);
+		}
+		enum highlight_state state = h->states[next - 1];
+		highlight_lex(h, &node, &ofs, &state);
+
+		if (next >= h->dirty_end && next < h->lexed && h->states[next] == state) {
+			h->frontier = h->lexed;
+			node	    = NULL;
+		}
+		else {
+			h->states[next] = state;
+			h->frontier	= next + 1;
+			h->lexed	= MAX(h->lexed, h->frontier);
+		}
+	}
+
+	// If lexing stopped short of converging, the lines after the frontier only
+	// agree with each other, not with the lines before them.
+	h->dirty_end = h->frontier < h->lexed ? MAX(h->dirty_end, h->frontier) : 0;
+	return true;
+}
+
+// Get the attribute of each byte of line, or NULL if it isn't highlighted.
+// *len is set to how many bytes have one.
+const uint8_t *highlight_line_attrs(struct highlight *h, rope *r, size_t line, size_t *len)
+{
+	if (!h->enabled || line >= rope_line_count(r) || !highlight_update(h, r, line)) {
+		return NULL;
+	}
+	size_t		     ofs;
+	rope_node	    *node  = rope_node_at(r, rope_line_to_char(r, line), &ofs);
+	enum highlight_state state = h->states[line];
+	*len			   = highlight_lex(h, &node, &ofs, &state);
+	return h->attrs;
+}
+
+// Lines are soft-wrapped at the width of their bounds. A character takes up as
+// many columns as it's drawn in (see render_char_width), and isn't split across
+// rows, except that a tab stops at the end of the row. A line which exactly
+// fills its last row takes up another row for its newline, so the cursor has
+// somewhere to go at the end of it.
+
+// The starts of every this many rows of a long line are checkpointed, so that
+// finding a row or a character in it only scans from the checkpoint before.
+#ifndef LAYOUT_CHECKPOINT_ROWS
+#define LAYOUT_CHECKPOINT_ROWS 64
+#endif
+
+// How many long lines' checkpoints are kept.
+#define LAYOUT_MAPS 4
+
+// A position in a line, as offsets from its start.
+struct layout_point {
+	size_t chars;
+	size_t bytes;
+};
+
+// The checkpoints of a line with more than LAYOUT_CHECKPOINT_ROWS rows.
+struct layout_map {
+	size_t		     line; // SIZE_MAX if unused
+	struct layout_point *points;
+	size_t		     num_points;
+	size_t		     points_size;
+	uint64_t	     last_used;
+};
+
+// How the lines of a file are laid out on screen, shared by the renderer and
+// the cursor. The number of rows each line takes up is worked out the first
+// time it's needed, and kept until the line is edited, so walking over lines
+// costs O(1) each.
+struct layout {
+	int width;
+
+	uint32_t *rows; // The rows each line takes up, or 0 if not known yet
+	size_t	  num_lines;
+	size_t	  rows_size;
+
+	struct layout_map maps[LAYOUT_MAPS];
+	struct layout_map scratch; // Checkpoints of the line being measured
+	uint64_t	  clock;
+};
+
+// A walk over the characters of a line in the order they're laid out. The walk
+// is on character c, whose len bytes start at node_ofs in node and which takes
+// up cells columns from col. At the end of the line len is 0, and row and col
+// are where the cursor goes after the last character.
+struct layout_walk {
+	rope_node	   *node;
+	size_t		    node_ofs;
+	struct layout_point pos;
+	size_t		    row;
+	int		    col;
+	uint32_t	    c;
+	int		    len;
+	int		    cells;
+	int		    width;
+};
+
+// Look at the character the walk is on, moving it to the next row if it
+// doesn't fit on this one.
+static void layout_walk_load(struct layout_walk *w)
+{
+	while (w->node != NULL && w->node_ofs == rope_node_num_bytes(w->node)) {
+		w->node	    = rope_node_next(w->node);
+		w->node_ofs = 0;
+	}
+
+	w->len	 = 0;
+	w->cells = 0;
+	if (w->node != NULL && rope_node_data(w->node)[w->node_ofs] != '\n') {
+		// Characters never cross node boundaries.
+		const uint8_t *data = rope_node_data(w->node) + w->node_ofs;
+		w->len		    = utf8_codepoint_size(data[0]);
+		w->c		    = w->len == 1 ? data[0] : utf8_decode(data, w->len);
+		w->cells	    = w->c == '\t' ? 1 : render_char_width(w->c, 0);
+	}
+
+	// Zero width characters and the end of the line still need somewhere for
+	// the cursor to go.
+	if (w->col > 0 && w->col + MAX(w->cells, 1) > w->width) {
+		w->row++;
+		w->col = 0;
+	}
+	if (w->len > 0 && w->c == '\t') {
+		w->cells = MIN(render_char_width('\t', w->col), w->width - w->col);
+	}
+}
+
+// Start a walk at the point at, which starts row of line.
+static void layout_walk_start(struct layout_walk *w, rope *r, size_t line, struct layout_point at, size_t row,
+			      int width)
+{
+	w->node	 = rope_node_at(r, rope_line_to_char(r, line) + at.chars, &w->node_ofs);
+	w->pos	 = at;
+	w->row	 = row;
+	w->col	 = 0;
+	w->width = width;
+	layout_walk_load(w);
+}
+
+// Move on to the next character. Returns false if the walk was already at the
+// end of the line.
+static bool layout_walk_next(struct layout_walk *w)
+{
+	if (w->len == 0) {
+		return false;
+	}
+	w->node_ofs += w->len;
+	w->pos.chars++;
+	w->pos.bytes += w->len;
+	w->col += w->cells;
+	layout_walk_load(w);
+	return true;
+}
+
+// Get how many printable ASCII characters there are from the walk's position
+// which fit on its row. These are most of most text, and take up a column and
+// a byte each, so they can be walked over in one go.
+static int layout_walk_ascii(struct layout_walk *w)
+{
+	if (w->len != 1 || w->c < ' ' || w->c > '~') {
+		return 0;
+	}
+	size_t n = rope_node_num_bytes(w->node) - w->node_ofs;
+	return utf8_count_printable(rope_node_data(w->node) + w->node_ofs, MIN(n, (size_t)(w->width - w->col)));
+}
+
+// Move on over n characters which layout_walk_ascii found.
+static void layout_walk_skip(struct layout_walk *w, int n)
+{
+	w->node_ofs += n;
+	w->pos.chars += n;
+	w->pos.bytes += n;
+	w->col += n;
+	layout_walk_load(w);
+}
+
+// Move on over a run of printable ASCII characters on this row, but no more
+// than max, or over one other character. Returns false if the walk was already
+// at the end of the line.
+static bool layout_walk_run(struct layout_walk *w, size_t max)
+{
+	size_t n = layout_walk_ascii(w);
+	if (n > 1 && max > 1) {
+		layout_walk_skip(w, MIN(n, max));
+		return true;
+	}
+	return layout_walk_next(w);
+}
+
+// Move a walk at the end of a line on to the start of the next one. Returns
+// false if it was the last line.
+static bool layout_walk_next_line(struct layout_walk *w)
+{
+	if (w->node == NULL) {
+		return false;
+	}
+	w->node_ofs++;
+	w->pos = (struct layout_point){};
+	w->row = 0;
+	w->col = 0;
+	layout_walk_load(w);
+	return true;
+}
+
+void layout_init(struct layout *l)
+{
+	memset(l, 0, sizeof(*l));
+	for (int i = 0; i < LAYOUT_MAPS; i++) {
+		l->maps[i].line = SIZE_MAX;
+	}
+}
+
+void layout_cleanup(struct layout *l)
+{
+	free(l->rows);
+	for (int i = 0; i < LAYOUT_MAPS; i++) {
+		free(l->maps[i].points);
+	}
+	free(l->scratch.points);
+	layout_init(l);
+}
+
+// Forget everything about the layout if it was for another width.
+static void layout_set_width(struct layout *l, int width)
+{
+	if (l->width == width) {
+		return;
+	}
+	l->width     = width;
+	l->num_lines = 0;
+	for (int i = 0; i < LAYOUT_MAPS; i++) {
+		l->maps[i].line = SIZE_MAX;
+	}
+}
+
+static bool layout_map_add(struct layout_map *map, struct layout_point point)
+{
+	if (map->num_points == map->points_size) {
+		size_t		     size  = MAX(16, map->points_size * 2);
+		struct layout_point *grown = realloc(map->points, size * sizeof(*grown));
+		if (grown == NULL) {
+			return false;
+		}
+		map->points	 = grown;
+		map->points_size = size;
+	}
+	map->points[map->num_points++] = point;
+	return true;
+}
+
+// Lay out the whole of line to count its rows. The checkpoints of a long line
+// are kept in place of those of the line least recently used.
+static uint32_t layout_measure(struct layout *l, rope *r, size_t line)
+{
+	struct layout_map *scratch = &l->scratch;
+	scratch->num_points	   = 0;
+
+	struct layout_walk w;
+	layout_walk_start(&w, r, line, (struct layout_point){}, 0, l->width);
+	bool   ok	= layout_map_add(scratch, w.pos);
+	size_t last_row = 0;
+	while (layout_walk_run(&w, SIZE_MAX)) {
+		if (w.row != last_row) {
+			last_row = w.row;
+			if (w.row % LAYOUT_CHECKPOINT_ROWS == 0) {
+				ok = ok && layout_map_add(scratch, w.pos);
+			}
+		}
+	}
+
+	uint32_t rows = MIN(w.row + 1, UINT32_MAX);
+	if (rows > LAYOUT_CHECKPOINT_ROWS && ok) {
+		struct layout_map *victim = &l->maps[0];
+		for (int i = 1; i < LAYOUT_MAPS; i++) {
+			if (l->maps[i].last_used < victim->last_used) {
+				victim = &l->maps[i];
+			}
+		}
+		struct layout_map map = *victim;
+		*victim		      = *scratch;
+		*scratch	      = map;
+		victim->line	      = line;
+		victim->last_used     = ++l->clock;
+	}
+	return rows;
+}
+
+static bool layout_reserve(struct layout *l, size_t num_lines)
+{
+	if (num_lines <= l->rows_size) {
+		return true;
+	}
+	size_t	  size	= MAX(num_lines, l->rows_size * 2);
+	uint32_t *grown = realloc(l->rows, size * sizeof(*grown));
+	if (grown == NULL) {
+		return false;
+	}
+	l->rows	     = grown;
+	l->rows_size = size;
+	return true;
+}
+
+// The number of rows line takes up when wrapped at width.
+uint32_t layout_line_rows(struct layout *l, rope *r, size_t line, int width)
+{
+	layout_set_width(l, width);
+	if (line >= l->num_lines) {
+		if (!layout_reserve(l, line + 1)) {
+			return layout_measure(l, r, line);
+		}
+		memset(l->rows + l->num_lines, 0, (line + 1 - l->num_lines) * sizeof(*l->rows));
+		l->num_lines = line + 1;
+	}
+	if (l->rows[line] == 0) {
+		l->rows[line] = layout_measure(l, r, line);
+	}
+	return l->rows[line];
+}
+
+// Get the checkpoints of line if it's a long one, laying it out again if they
+// were dropped.
+static struct layout_map *layout_map(struct layout *l, rope *r, size_t line, int width)
+{
+	if (layout_line_rows(l, r, line, width) <= LAYOUT_CHECKPOINT_ROWS) {
+		return NULL;
+	}
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < LAYOUT_MAPS; i++) {
+			if (l->maps[i].line == line) {
+				l->maps[i].last_used = ++l->clock;
+				return &l->maps[i];
+			}
+		}
+		layout_measure(l, r, line);
+	}
+	return NULL;
+}
+
+// Start a walk at the start of row of line, or of its last row if it doesn't
+// have that many.
+void layout_seek_row(struct layout *l, rope *r, size_t line, size_t row, int width, struct layout_walk *w)
+{
+	row = MIN(row, layout_line_rows(l, r, line, width) - 1);
+
+	struct layout_point at	   = {};
+	size_t		    at_row = 0;
+	struct layout_map  *map	   = layout_map(l, r, line, width);
+	if (map != NULL && map->num_points > 0) {
+		size_t i = MIN(row / LAYOUT_CHECKPOINT_ROWS, map->num_points - 1);
+		at	 = map->points[i];
+		at_row	 = i * LAYOUT_CHECKPOINT_ROWS;
+	}
+
+	layout_walk_start(w, r, line, at, at_row, width);
+	while (w->row < row && layout_walk_run(w, SIZE_MAX)) {
+	}
+}
+
+// Start a walk at the character chars into line, or at its end.
+void layout_seek_char(struct layout *l, rope *r, size_t line, size_t chars, int width, struct layout_walk *w)
+{
+	struct layout_point at	   = {};
+	size_t		    at_row = 0;
+	struct layout_map  *map	   = layout_map(l, r, line, width);
+	if (map != NULL && map->num_points > 0) {
+		size_t lo = 0;
+		size_t hi = map->num_points;
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (map->points[mid].chars <= chars) {
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		at     = map->points[lo];
+		at_row = lo * LAYOUT_CHECKPOINT_ROWS;
+	}
+
+	layout_walk_start(w, r, line, at, at_row, width);
+	while (w->pos.chars < chars && layout_walk_run(w, chars - w->pos.chars)) {
+	}
+}
+
+// Account for an edit starting on line which replaced removed newlines with
+// added ones. Only the lines the edit touched have to be laid out again.
+void layout_edit(struct layout *l, size_t line, size_t removed, size_t added)
+{
+	size_t old_end = line + 1 + removed;
+	size_t new_end = line + 1 + added;
+
+	for (int i = 0; i < LAYOUT_MAPS; i++) {
+		struct layout_map *map = &l->maps[i];
+		if (map->line == SIZE_MAX || map->line < line) {
+			continue;
+		}
+		map->line = map->line < old_end ? SIZE_MAX : map->line - old_end + new_end;
+	}
+
+	if (line >= l->num_lines) {
+		return;
+	}
+	if (old_end >= l->num_lines) {
+		l->num_lines = line;
+		return;
+	}
+
+	// The rows of the lines after the edit are moved along with them.
+	size_t num_kept = l->num_lines - old_end;
+	if (!layout_reserve(l, new_end + num_kept)) {
+		l->num_lines = line;
+		return;
+	}
+	memmove(l->rows + new_end, l->rows + old_end, num_kept * sizeof(*l->rows));
+	memset(l->rows + line, 0, (new_end - line) * sizeof(*l->rows));
+	l->num_lines = new_end + num_kept;
+}
+
+struct file_buffer {
+	rope *rope;
+	char  *pathname;
+	size_t cursor_pos;
+	int    cursor_row;
+	int    cursor_col;
+
+	// The line the cursor was last seen on.
+	size_t cursor_line;
+
+	// The row of the file shown at the top of the screen, as a line and how many
+	// of its rows are scrolled off. cursor_row is counted from here, so nothing
+	// ever has to be laid out from the start of the file.
+	size_t top_line;
+	int    top_line_row;
+
+	struct undo_history history;
+	struct highlight    highlight;
+	struct layout	    layout;
+
+	struct bounds bounds;
+};
+
+int  file_buffer_init_from_file(struct file_buffer *file, char *pathname);
+void file_buffer_render_to_context(struct file_buffer *file, struct render_context *ctx, struct bounds *bounds);
+void file_buffer_cleanup(struct file_buffer *file);
+
+// Files at least this large are mapped into memory rather than read. The rope
+// refers to the mapping directly, so only the parts of the file which are
+// edited get copied.
+#define FILE_BUFFER_MMAP_THRESHOLD (64 * 1024 * 1024)
+
+static void file_buffer_unmap(const uint8_t *buf, size_t num_bytes, void *ctx)
+{
+	(void)ctx;
+	munmap((void *)buf, num_bytes);
+}
+
+static int file_buffer_init_from_mapping(struct file_buffer *file, int fd, size_t size)
+{
+	void *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+		return -1;
+	}
+
+	// The rope is built with one pass over the file to count characters and
+	// newlines. Nothing is copied, so pages can be dropped as soon as they
+	// have been read.
+	madvise(buf, size, MADV_SEQUENTIAL);
+	file->rope = rope_new_with_external(buf, size, file_buffer_unmap, NULL);
+	if (file->rope == NULL) {
+		munmap(buf, size);
+		return -1;
+	}
+	madvise(buf, size, MADV_NORMAL);
+
+	return 0;
+}
+
+int file_buffer_init_from_file(struct file_buffer *file, char *pathname)
+{
+	undo_history_init(&file->history, UNDO_HISTORY_LIMIT);
+	highlight_init(&file->highlight, pathname);
+	layout_init(&file->layout);
+
+	// The file keeps its own copy of the path, as it may come from a search
+	// result which goes away.
+	file->pathname = strdup(pathname);
+	if (file->pathname == NULL) {
+		return -1;
+	}
+
+	struct stat st;
+	if (stat(pathname, &st) == -1) {
+		return -1;
+	}
+
+	int fd = open(pathname, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (st.st_size >= FILE_BUFFER_MMAP_THRESHOLD) {
+		int ret = file_buffer_init_from_mapping(file, fd, st.st_size);
+		close(fd);
+		return ret;
+	}
+
+	char *buf = malloc(st.st_size + 1); // +1 so empty files get a buffer too
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	// Large files may take more than one read
+	off_t buf_len = 0;
+	while (buf_len < st.st_size) {
+		ssize_t n = read(fd, buf + buf_len, st.st_size - buf_len);
+		if (n == -1) {
+			free(buf);
+			close(fd);
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		buf_len += n;
+	}
+
+	close(fd);
+
+	file->rope = rope_new_from_buffer((uint8_t *)buf, buf_len);
+	free(buf);
+	if (file->rope == NULL) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// Move a row of the file, given as a line and a row of that line, down by n
+// rows, stopping at the last row of the file. Returns how far it moved.
+static int file_buffer_rows_down(struct file_buffer *file, struct bounds *bounds, size_t *line, int *row, int n)
+{
+	size_t num_lines = rope_line_count(file->rope);
+	int    moved	 = 0;
+	for (;;) {
+		int rows = layout_line_rows(&file->layout, file->rope, *line, bounds->width);
+		if (*row + n - moved < rows || *line + 1 >= num_lines) {
+			int to = MIN(*row + n - moved, rows - 1);
+			moved += to - *row;
+			*row  = to;
+			return moved;
+		}
+		moved += rows - *row;
+		(*line)++;
+		*row = 0;
+	}
+}
+
+// Move a row of the file up by n rows, stopping at the first row.
+static void file_buffer_rows_up(struct file_buffer *file, struct bounds *bounds, size_t *line, int *row, int n)
+{
+	while (n > *row && *line > 0) {
+		n -= *row + 1;
+		(*line)--;
+		*row = layout_line_rows(&file->layout, file->rope, *line, bounds->width) - 1;
+	}
+	*row = MAX(*row - n, 0);
+}
+
+// Count the rows from one row of the file down to another, which isn't above
+// it. Counting stops once there are more than limit, so this costs O(limit) no
+// matter how far apart they are.
+static int file_buffer_rows_between(struct file_buffer *file, struct bounds *bounds, size_t from_line, int from_row,
+				    size_t to_line, int to_row, int limit)
+{
+	int rows = to_row - from_row;
+	for (size_t line = from_line; line < to_line && rows <= limit; line++) {
+		rows += layout_line_rows(&file->layout, file->rope, line, bounds->width);
+	}
+	return MIN(rows, limit + 1);
+}
+
+void file_buffer_render_to_context(struct file_buffer *file, struct render_context *ctx, struct bounds *bounds)
+{
+	// Only the rows which end up on screen are drawn, starting from the top of
+	// the screen, so drawing costs the same however far into the file it is.
+	int first_row = MAX(0, -bounds->row);
+	int last_row  = MIN(bounds->height, ctx->rows - bounds->row);
+	if (first_row >= last_row) {
+		return;
+	}
+
+	size_t line	= file->top_line;
+	int    line_row = file->top_line_row;
+	if (file_buffer_rows_down(file, bounds, &line, &line_row, first_row) < first_row) {
+		return;
+	}
+	struct layout_walk w;
+	layout_seek_row(&file->layout, file->rope, line, line_row, bounds->width, &w);
+	line_row = first_row - w.row;
+
+	// Walk the characters of each line in place, starting at the first visible
+	// one, and stop as soon as the last visible row has been filled. The rest of
+	// each row is whatever was already in screen_buffer.
+	int end = MIN(bounds->col + bounds->width, ctx->cols);
+	do {
+		size_t	       num_attrs;
+		const uint8_t *attrs = highlight_line_attrs(&file->highlight, file->rope, line++, &num_attrs);
+
+		while (w.len > 0) {
+			int row = line_row + w.row;
+			if (row >= last_row) {
+				return;
+			}
+
+			// Runs of printable ASCII are copied in whole, and anything else is
+			// drawn a character at a time.
+			int	       screen_row = bounds->row + row;
+			int	       col	  = bounds->col + w.col;
+			size_t	       ofs	  = w.pos.bytes;
+			const uint8_t *data	  = rope_node_data(w.node) + w.node_ofs;
+			int	       n	  = layout_walk_ascii(&w);
+			int	       cells	  = n;
+			if (n > 0) {
+				render_context_put_ascii(ctx, screen_row, col, end, data, n);
+				layout_walk_skip(&w, n);
+			}
+			else {
+				cells = w.cells;
+				render_context_put_char(ctx, screen_row, col, end, w.c, cells);
+				layout_walk_next(&w);
+			}
+
+			// Every cell of a character gets the attribute of its first byte.
+			uint8_t *out = ctx->attr_buffer + screen_row * ctx->cols;
+			for (int i = MAX(col, 0); attrs != NULL && i < MIN(col + cells, end); i++) {
+				size_t attr_ofs = n > 0 ? ofs + (i - col) : ofs;
+				if (attr_ofs < num_attrs) {
+					out[i] = attrs[attr_ofs];
+				}
+			}
+		}
+		line_row += w.row + 1;
+	} while (line_row < last_row && layout_walk_next_line(&w));
+}
+
+// Work out where the cursor is on screen, scrolling to keep it there. Moving a
+// little off the screen scrolls just far enough to show the cursor again, and
+// jumping further puts it in the middle.
+void file_buffer_update_cursor_coords(struct file_buffer *file, struct bounds *bounds)
+{
+	size_t line = rope_char_to_line(file->rope, file->cursor_pos);
+
+	struct layout_walk w;
+	size_t		   line_ofs = file->cursor_pos - rope_line_to_char(file->rope, line);
+	layout_seek_char(&file->layout, file->rope, line, line_ofs, bounds->width, &w);
+	file->cursor_line = line;
+	file->cursor_col  = w.col;
+
+	int height = MAX(bounds->height, 1);
+	int row	   = w.row;
+
+	// The top line may have got shorter since it was scrolled to.
+	int top_rows	   = layout_line_rows(&file->layout, file->rope, file->top_line, bounds->width);
+	file->top_line_row = MIN(file->top_line_row, top_rows - 1);
+
+	if (line < file->top_line || (line == file->top_line && row < file->top_line_row)) {
+		int above = file_buffer_rows_between(file, bounds, line, row, file->top_line, file->top_line_row, height);
+		file->top_line	   = line;
+		file->top_line_row = row;
+		if (above > height) {
+			file_buffer_rows_up(file, bounds, &file->top_line, &file->top_line_row, height / 2);
+		}
+	}
+	else {
+		int below = file_buffer_rows_between(file, bounds, file->top_line, file->top_line_row, line, row,
+						     2 * height);
+		if (below >= height) {
+			file->top_line	   = line;
+			file->top_line_row = row;
+			file_buffer_rows_up(file, bounds, &file->top_line, &file->top_line_row,
+					    below > 2 * height ? height / 2 : height - 1);
+		}
+	}
+
+	file->cursor_row =
+		file_buffer_rows_between(file, bounds, file->top_line, file->top_line_row, line, row, height);
+}
+
+// Put the cursor on a row of the file, at the cursor's column, or on the last
+// character of the row if it's shorter.
+static void file_buffer_move_cursor_to_row(struct file_buffer *file, struct bounds *bounds, size_t line, int row)
+{
+	struct layout_walk w;
+	layout_seek_row(&file->layout, file->rope, line, row, bounds->width, &w);
+	while (w.len > 0 && w.col + w.cells <= file->cursor_col) {
+		struct layout_walk next = w;
+		layout_walk_next(&next);
+		if (next.row != w.row) {
+			break;
+		}
+		w = next;
+	}
+	file->cursor_pos = rope_line_to_char(file->rope, line) + w.pos.chars;
+	file_buffer_update_cursor_coords(file, bounds);
+}
+
+static void file_buffer_move_cursor_to_line(struct file_buffer *file, struct bounds *bounds, size_t line)
+{
+	file_buffer_move_cursor_to_row(file, bounds, line, 0);
+}
+
+void file_buffer_move_cursor_prev_char(struct file_buffer *file, struct bounds *bounds)
+{
+	if (file->cursor_pos == 0) {
+		return;
+	}
+	file->cursor_pos--;
+	file_buffer_update_cursor_coords(file, bounds);
+}
+
+void file_buffer_move_cursor_next_char(struct file_buffer *file, struct bounds *bounds)
+{
+	if (file->cursor_pos >= rope_char_count(file->rope)) {
+		return;
+	}
+	file->cursor_pos++;
+	file_buffer_update_cursor_coords(file, bounds);
+}
+
+void file_buffer_move_cursor_prev_line(struct file_buffer *file, struct bounds *bounds)
+{
+	size_t line = rope_char_to_line(file->rope, file->cursor_pos);
+
+	// If we're already at the first line, nothing to do
+	if (line == 0) {
+		return;
+	}
+	file_buffer_move_cursor_to_line(file, bounds, line - 1);
+}
+
+void file_buffer_move_cursor_next_line(struct file_buffer *file, struct bounds *bounds)
+{
+	size_t line	  = rope_char_to_line(file->rope, file->cursor_pos);
+	size_t line_count = rope_line_count(file->rope);
+
+	// If we're already at the last line, nothing to do
+	if (line + 1 >= line_count) {
+		return;
+	}
+	file_buffer_move_cursor_to_line(file, bounds, line + 1);
+}
+
+// Scroll a screen down or up, keeping the cursor on the same row of the
+// screen. Two rows of the screen before are kept on screen.
+void file_buffer_page(struct file_buffer *file, struct bounds *bounds, bool down)
+{
+	int rows = MAX(bounds->height - 2, 1);
+	if (down) {
+		file_buffer_rows_down(file, bounds, &file->top_line, &file->top_line_row, rows);
+	}
+	else {
+		file_buffer_rows_up(file, bounds, &file->top_line, &file->top_line_row, rows);
+	}
+
+	size_t line = file->top_line;
+	int    row  = file->top_line_row;
+	file_buffer_rows_down(file, bounds, &line, &row, file->cursor_row);
+	file_buffer_move_cursor_to_row(file, bounds, line, row);
+}
+
+// Move the cursor to the start of line, counting from 0, or of the last line.
+void file_buffer_goto_line(struct file_buffer *file, struct bounds *bounds, size_t line)
+{
+	line		 = MIN(line, rope_line_count(file->rope) - 1);
+	file->cursor_pos = rope_line_to_char(file->rope, line);
+	file_buffer_update_cursor_coords(file, bounds);
+}
+
+// Account for an edit starting on line which replaces removed newlines with
+// added ones, in everything kept about the lines.
+static void file_buffer_edit_lines(struct file_buffer *file, size_t line, size_t removed, size_t added)
+{
+	highlight_edit(&file->highlight, line, removed, added);
+	layout_edit(&file->layout, line, removed, added);
+
+	// Keep the top of the screen on the same text if the edit was above it.
+	if (file->top_line > line) {
+		if (file->top_line <= line + removed) {
+			file->top_line	   = line;
+			file->top_line_row = 0;
+		}
+		else {
+			file->top_line += added - removed;
+		}
+	}
+}
+
+// Insert len bytes of utf8 at the cursor, and move the cursor past them. Returns
+// -1, inserting nothing, if the text isn't valid utf8.
+int file_buffer_insert(struct file_buffer *file, const char *str, size_t len)
+{
+	size_t num_chars = rope_char_count(file->rope);
+	size_t line	 = rope_char_to_line(file->rope, file->cursor_pos);
+	if (rope_insert_n(file->rope, file->cursor_pos, (const uint8_t *)str, len) != ROPE_OK) {
+		return -1;
+	}
+	file_buffer_edit_lines(file, line, 0, count_newlines(str, len));
+	size_t inserted_chars = rope_char_count(file->rope) - num_chars;
+	undo_history_insert(&file->history, file->cursor_pos, str, len, inserted_chars);
+	file->cursor_pos += inserted_chars;
+	return 0;
+}
+
+void file_buffer_delete(struct file_buffer *file, struct bounds *bounds)
+{
+	if (file->cursor_pos == 0) {
+		return;
+	}
+
+	// Move the cursor before deleting, so that joining two lines is accounted
+	// for with the rows the previous line took up before the join.
+	file_buffer_move_cursor_prev_char(file, bounds);
+
+	// Characters never cross node boundaries, so the character is all in one node.
+	size_t	   ofs;
+	rope_node *node = rope_node_at(file->rope, file->cursor_pos, &ofs);
+	if (ofs == rope_node_num_bytes(node)) {
+		node = rope_node_next(node);
+		ofs  = 0;
+	}
+	const char *c = (const char *)&rope_node_data(node)[ofs];
+	undo_history_delete(&file->history, file->cursor_pos, c, utf8_codepoint_size(*c), 1);
+	file_buffer_edit_lines(file, file->cursor_line, *c == '\n', 0);
+
+	rope_del(file->rope, file->cursor_pos, 1);
+}
+
+// Replace num_chars characters at pos with the len bytes at str, without
+// recording it in the history. The cursor is moved to pos first, so the edit is
+// accounted for like one made by typing, and ends up after the new text.
+static void file_buffer_replace(struct file_buffer *file, struct bounds *bounds, size_t pos, size_t num_chars,
+				const char *str, size_t len)
+{
+	file->cursor_pos = pos;
+	file_buffer_update_cursor_coords(file, bounds);
+
+	size_t removed = rope_char_to_line(file->rope, pos + num_chars) - file->cursor_line;
+	file_buffer_edit_lines(file, file->cursor_line, removed, count_newlines(str, len));
+
+	if (num_chars > 0) {
+		rope_del(file->rope, pos, num_chars);
+	}
+	size_t total_chars = rope_char_count(file->rope);
+	if (len > 0) {
+		rope_insert_n(file->rope, pos, (const uint8_t *)str, len);
+	}
+
+	file->cursor_pos = pos + rope_char_count(file->rope) - total_chars;
+	file_buffer_update_cursor_coords(file, bounds);
+}
+
+// Undo the last undo unit. Each edit in it costs one delete and one insert.
+// Returns false if there's nothing to undo.
+bool file_buffer_undo(struct file_buffer *file, struct bounds *bounds)
+{
+	struct undo_history *h	 = &file->history;
+	struct undo_record  *rec = undo_history_step_back(h);
+	if (rec == NULL) {
+		return false;
+	}
+
+	for (; rec != NULL; rec = rec->group_start ? NULL : undo_history_step_back(h)) {
+		file_buffer_replace(file, bounds, rec->pos, rec->inserted_chars, undo_record_deleted(rec), rec->deleted_len);
+	}
+	undo_history_break(h);
+	return true;
+}
+
+// Redo the last undo unit which was undone. Returns false if there's nothing to redo.
+bool file_buffer_redo(struct file_buffer *file, struct bounds *bounds)
+{
+	struct undo_history *h	 = &file->history;
+	struct undo_record  *rec = undo_history_step_forward(h);
+	if (rec == NULL) {
+		return false;
+	}
+
+	for (; rec != NULL; rec = undo_history_at_group_start(h) ? NULL : undo_history_step_forward(h)) {
+		file_buffer_replace(file, bounds, rec->pos, rec->deleted_chars, undo_record_inserted(rec), rec->inserted_len);
+	}
+	undo_history_break(h);
+	return true;
+}
+
+void file_buffer_cleanup(struct file_buffer *file)
+{
+	if (file->rope != NULL) {
+		rope_free(file->rope);
+	}
+	free(file->pathname);
+	undo_history_cleanup(&file->history);
+	highlight_cleanup(&file->highlight);
+	layout_cleanup(&file->layout);
+}
+
+// Queries longer than this can't be searched for.
+#define SEARCH_QUERY_SIZE 256
+
+// Queries up to this long are found by looking for their first byte with
+// memchr. Longer ones skip ahead with Horspool's algorithm.
+#define SEARCH_MEMCHR_MAX 3
+
+// A literal search is matched byte for byte against the rope's nodes in place,
+// however large the file is. A query which is valid utf8 can only match at the
+// start of a character.
+struct search_pattern {
+	const uint8_t *needle;
+	size_t	       len;
+
+	// How far the window can move along when its last byte is the index.
+	size_t shift[256];
+};
+
+static void search_pattern_init(struct search_pattern *p, const char *needle, size_t len)
+{
+	p->needle = (const uint8_t *)needle;
+	p->len	  = len;
+	for (int c = 0; c < 256; c++) {
+		p->shift[c] = len;
+	}
+	for (size_t i = 0; i + 1 < len; i++) {
+		p->shift[p->needle[i]] = len - 1 - i;
+	}
+}
+
+// Whether the needle occurs at byte ofs of node, carrying on into the nodes
+// after it if need be.
+static bool search_match_at(rope_node *node, size_t ofs, const uint8_t *needle, size_t len)
+{
+	while (len > 0) {
+		if (node == NULL) {
+			return false;
+		}
+		size_t n = MIN(len, rope_node_num_bytes(node) - ofs);
+		if (memcmp(&rope_node_data(node)[ofs], needle, n) != 0) {
+			return false;
+		}
+		needle += n;
+		len -= n;
+		node = rope_node_next(node);
+		ofs  = 0;
+	}
+	return true;
+}
+
+// Find the first match which starts in node at or after byte ofs. Returns the
+// byte offset of the match, or -1.
+static ssize_t search_node(struct search_pattern *p, rope_node *node, size_t ofs)
+{
+	const uint8_t *data = rope_node_data(node);
+	size_t	       n    = rope_node_num_bytes(node);
+	size_t	       m    = p->len;
+
+	if (m > SEARCH_MEMCHR_MAX) {
+		uint8_t last = p->needle[m - 1];
+		while (ofs + m <= n) {
+			uint8_t c = data[ofs + m - 1];
+			if (c == last && memcmp(&data[ofs], p->needle, m - 1) == 0) {
+				return ofs;
+			}
+			ofs += p->shift[c];
+		}
+	}
+
+	// What's left are matches which would run on past the end of the node.
+	while (ofs < n) {
+		const uint8_t *c = memchr(&data[ofs], p->needle[0], n - ofs);
+		if (c == NULL) {
+			return -1;
+		}
+		ofs = c - data;
+		if (search_match_at(node, ofs, p->needle, m)) {
+			return ofs;
+		}
+		ofs++;
+	}
+	return -1;
+}
+
+// Find the first match of the len bytes at query which starts at a character
+// position in [from, to). Returns the match's position, or -1.
+ssize_t file_buffer_find(struct file_buffer *file, size_t from, size_t to, const char *query, size_t len)
+{
+	if (len == 0 || from >= to) {
+		return -1;
+	}
+
+	struct search_pattern p;
+	search_pattern_init(&p, query, len);
+
+	size_t	   ofs;
+	rope_node *node	    = rope_node_at(file->rope, from, &ofs);
+	size_t	   node_pos = from - utf8_count_chars(rope_node_data(node), ofs);
+
+	for (; node != NULL && node_pos < to; node = rope_node_next(node), ofs = 0) {
+		ssize_t match = search_node(&p, node, ofs);
+		if (match >= 0) {
+			size_t pos = node_pos + utf8_count_chars(rope_node_data(node), match);
+			return pos < to ? (ssize_t)pos : -1;
+		}
+		node_pos += rope_node_chars(node);
+	}
+	return -1;
+}
+
+// Find the first match after the character at pos, wrapping around to the start
+// of the file. A match at pos itself is found last. Returns -1 if there's none.
+ssize_t file_buffer_find_next(struct file_buffer *file, size_t pos, const char *query, size_t len)
+{
+	size_t	total = rope_char_count(file->rope);
+	size_t	start = MIN(pos + 1, total);
+	ssize_t match = file_buffer_find(file, start, total, query, len);
+	return match != -1 ? match : file_buffer_find(file, 0, start, query, len);
+}
+
+// Regex searches split the file into chunks of about this many bytes, which
+// are scanned in parallel. Chunks start at the start of a line, and matches
+// never span lines, so no match can straddle two chunks.
+#ifndef REGEX_CHUNK_SIZE
+#define REGEX_CHUNK_SIZE (1024 * 1024)
+#endif
+
+// The most threads a regex search runs on.
+#define REGEX_MAX_THREADS 64
+
+// A run of whole lines, from byte ofs of node up to byte end_ofs of end_node.
+struct regex_chunk {
+	rope_node *node;
+	size_t	   ofs;
+	size_t	   pos; // Where node starts.
+	rope_node *end_node;
+	size_t	   end_ofs;
+
+	size_t	count;
+	ssize_t first;
+	ssize_t next;
+};
+
+// A regex search, shared by the threads running it. Each thread takes the next
+// chunk until there are none left.
+struct regex_search {
+	const re	   *re;
+	size_t		    after;
+	struct regex_chunk *chunks;
+	int		    num_chunks;
+	atomic_int	    next_chunk;
+
+	// Where the file ends if it doesn't end with a newline, in which case the
+	// last line may match at the end of the last chunk. Otherwise -1.
+	ssize_t open_end;
+};
+
+// The results of a regex search.
+struct regex_result {
+	// The number of lines with a match, as grep -c counts them.
+	size_t count;
+
+	// Where the first match in the file ends, and where the first one which
+	// ends at or after the search's after position ends. -1 if there's none.
+	ssize_t first;
+	ssize_t next;
+};
+
+static void regex_chunk_add_match(struct regex_search *search, struct regex_chunk *chunk, size_t end)
+{
+	chunk->count++;
+	if (chunk->first == -1) {
+		chunk->first = end;
+	}
+	if (chunk->next == -1 && end >= search->after) {
+		chunk->next = end;
+	}
+}
+
+// Count the lines in a chunk with a match. Once a line has matched, the rest of
+// it is skipped with memchr.
+static void regex_scan_chunk(struct regex_search *search, struct regex_chunk *chunk)
+{
+	const re  *re	     = search->re;
+	re_state   state     = re_scan_start(re, true);
+	bool	   skip_line = false;
+	rope_node *node	     = chunk->node;
+	size_t	   ofs	     = chunk->ofs;
+	size_t	   pos	     = chunk->pos;
+
+	for (;;) {
+		const uint8_t *data  = rope_node_data(node);
+		size_t	       limit = node == chunk->end_node ? chunk->end_ofs : rope_node_num_bytes(node);
+
+		// Character positions are only worked out while they're needed, as a
+		// node from a mapped file can be very large.
+		size_t counted	   = 0;
+		size_t counted_pos = pos;
+
+		while (ofs < limit) {
+			if (skip_line) {
+				const uint8_t *nl = memchr(&data[ofs], '\n', limit - ofs);
+				if (nl == NULL) {
+					break;
+				}
+				ofs	  = nl - data + 1;
+				skip_line = false;
+				state	  = re_scan_start(re, true);
+				continue;
+			}
+
+			size_t end;
+			if (!re_scan(re, &state, &data[ofs], limit - ofs, &end)) {
+				break;
+			}
+			ofs += end;
+			if (chunk->next == -1) {
+				counted_pos += utf8_count_chars(&data[counted], ofs - counted);
+				counted = ofs;
+			}
+			regex_chunk_add_match(search, chunk, counted_pos);
+			skip_line = true;
+		}
+
+		if (node == chunk->end_node) {
+			break;
+		}
+		pos += rope_node_chars(node);
+		node = rope_node_next(node);
+		ofs  = 0;
+	}
+
+	if (chunk == &search->chunks[search->num_chunks - 1] && search->open_end != -1 && !skip_line &&
+	    re_scan_finish(re, state)) {
+		regex_chunk_add_match(search, chunk, search->open_end);
+	}
+}
+
+static void *regex_search_run(void *arg)
+{
+	struct regex_search *search = arg;
+	for (;;) {
+		int i = atomic_fetch_add(&search->next_chunk, 1);
+		if (i >= search->num_chunks) {
+			return NULL;
+		}
+		regex_scan_chunk(search, &search->chunks[i]);
+	}
+}
+
+// Search the whole file for re on as many threads as there are cores, and
+// merge what each chunk found in order. Matches are found by where they end,
+// and after is where the result's next match may end from.
+int file_buffer_regex_search(struct file_buffer *file, const re *re, size_t after, struct regex_result *result)
+{
+	rope  *r	  = file->rope;
+	size_t total	  = rope_char_count(r);
+	size_t max_chunks = rope_byte_count(r) / REGEX_CHUNK_SIZE + 1;
+
+	struct regex_search search = {
+		.re	  = re,
+		.after	  = after,
+		.chunks	  = malloc(max_chunks * sizeof(struct regex_chunk)),
+		.open_end = rope_line_to_char(r, rope_line_count(r) - 1) < total ? (ssize_t)total : -1,
+	};
+	if (search.chunks == NULL) {
+		return -1;
+	}
+
+	// Split the file up evenly, moving each split back to the start of its line.
+	size_t start = 0;
+	for (size_t i = 1; i <= max_chunks; i++) {
+		size_t end = total;
+		if (i < max_chunks) {
+			end = rope_line_to_char(r, rope_char_to_line(r, total / max_chunks * i));
+		}
+		if (end <= start) {
+			continue;
+		}
+		struct regex_chunk *chunk = &search.chunks[search.num_chunks++];
+		chunk->node		  = rope_node_at(r, start, &chunk->ofs);
+		chunk->pos		  = start - utf8_count_chars(rope_node_data(chunk->node), chunk->ofs);
+		chunk->end_node		  = rope_node_at(r, end, &chunk->end_ofs);
+		chunk->count		  = 0;
+		chunk->first		  = -1;
+		chunk->next		  = -1;
+		start			  = end;
+	}
+
+	// This thread does its share too.
+	long	  num_cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+	int	  num_threads = MIN(MIN(MAX(num_cpus, 1), REGEX_MAX_THREADS), search.num_chunks) - 1;
+	int	  started     = 0;
+	pthread_t threads[REGEX_MAX_THREADS];
+	while (started < num_threads && pthread_create(&threads[started], NULL, regex_search_run, &search) == 0) {
+		started++;
+	}
+	regex_search_run(&search);
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	result->count = 0;
+	result->first = -1;
+	result->next  = -1;
+	for (int i = 0; i < search.num_chunks; i++) {
+		struct regex_chunk *chunk = &search.chunks[i];
+		result->count += chunk->count;
+		if (result->first == -1) {
+			result->first = chunk->first;
+		}
+		if (result->next == -1) {
+			result->next = chunk->next;
+		}
+	}
+	free(search.chunks);
+	return 0;
+}
+
+// Find the leftmost match of re in a line which starts at or after character
+// pos, or anywhere in the line if pos is before it. Returns where it starts, or
+// -1 if there's none.
+ssize_t file_buffer_regex_match_line(struct file_buffer *file, const re *re, size_t line, size_t pos)
+{
+	size_t	   ofs;
+	size_t	   line_start = rope_line_to_char(file->rope, line);
+	rope_node *node	      = rope_node_at(file->rope, line_start, &ofs);
+
+	// Copy the line out, as it may be spread over several nodes.
+	size_t	 size = 256;
+	size_t	 len  = 0;
+	uint8_t *buf  = malloc(size);
+	for (; buf != NULL && node != NULL; node = rope_node_next(node), ofs = 0) {
+		const uint8_t *data  = &rope_node_data(node)[ofs];
+		size_t	       avail = rope_node_num_bytes(node) - ofs;
+		const uint8_t *nl    = memchr(data, '\n', avail);
+		size_t	       n     = nl != NULL ? (size_t)(nl - data) : avail;
+		if (len + n > size) {
+			size	       = MAX(size * 2, len + n);
+			uint8_t *grown = realloc(buf, size);
+			if (grown == NULL) {
+				free(buf);
+				return -1;
+			}
+			buf = grown;
+		}
+		memcpy(&buf[len], data, n);
+		len += n;
+		if (nl != NULL) {
+			break;
+		}
+	}
+	if (buf == NULL) {
+		return -1;
+	}
+
+	size_t from = pos > line_start ? pos - line_start : 0;
+	size_t	start, end;
+	ssize_t match = -1;
+	if (from <= utf8_count_chars(buf, len) && re_match(re, buf, len, utf8_count_bytes(buf, from), &start, &end)) {
+		match = line_start + utf8_count_chars(buf, start);
+	}
+	free(buf);
+	return match;
+}
+
+// A save running on a background thread. The thread writes out a snapshot of
+// the document while the editor carries on with the real one.
+struct file_save {
+	pthread_t thread;
+	bool	  running;
+
+	rope *snapshot;
+	char *pathname;
+
+	// The thread writes a byte here when it's done, to wake up the main loop.
+	int done_pipe[2];
+
+	// 0 if the save succeeded, otherwise the errno it failed with.
+	int error;
+};
+
+// The most iovecs passed to writev at once.
+#define FILE_SAVE_IOV_MAX 1024
+
+int  file_save_init(struct file_save *save);
+int  file_save_start(struct file_save *save, struct file_buffer *file);
+int  file_save_finish(struct file_save *save);
+void file_save_cleanup(struct file_save *save);
+
+int file_save_init(struct file_save *save)
+{
+	save->running = false;
+	return pipe(save->done_pipe);
+}
+
+// Write out all of iov, carrying on after short writes.
+static int file_save_writev(int fd, struct iovec *iov, int iov_len)
+{
+	while (iov_len > 0) {
+		ssize_t n = writev(fd, iov, iov_len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		while (iov_len > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iov_len--;
+		}
+		if (iov_len > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+// Write the rope to fd straight from its nodes, without flattening it first.
+static int file_save_write_rope(int fd, rope *r)
+{
+	struct iovec iov[FILE_SAVE_IOV_MAX];
+	int	     iov_len = 0;
+	ROPE_FOREACH(r, node)
+	{
+		if (rope_node_num_bytes(node) == 0) {
+			continue;
+		}
+		iov[iov_len].iov_base = rope_node_data(node);
+		iov[iov_len].iov_len  = rope_node_num_bytes(node);
+		if (++iov_len == FILE_SAVE_IOV_MAX) {
+			if (file_save_writev(fd, iov, iov_len) == -1) {
+				return -1;
+			}
+			iov_len = 0;
+		}
+	}
+	return file_save_writev(fd, iov, iov_len);
+}
+
+// Write the rope to a temporary file next to pathname, then rename it over
+// pathname once it's safely on disk. Either the old or the new contents are
+// left behind, never a mix.
+static int file_save_write(rope *r, char *pathname)
+{
+	size_t pathname_len = strlen(pathname);
+	char  *tmp_pathname = malloc(pathname_len + sizeof(".XXXXXX"));
+	if (tmp_pathname == NULL) {
+		return -1;
+	}
+	memcpy(tmp_pathname, pathname, pathname_len);
+	memcpy(tmp_pathname + pathname_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+	int fd = mkstemp(tmp_pathname);
+	if (fd == -1) {
+		free(tmp_pathname);
+		return -1;
+	}
+
+	// mkstemp makes the file private. Keep the permissions of the file being replaced.
+	struct stat st;
+	mode_t	    mode = stat(pathname, &st) == 0 ? st.st_mode & 07777 : 0644;
+
+	if (fchmod(fd, mode) == -1 || file_save_write_rope(fd, r) == -1 || fsync(fd) == -1) {
+		int error = errno;
+		close(fd);
+		unlink(tmp_pathname);
+		free(tmp_pathname);
+		errno = error;
+		return -1;
+	}
+
+	if (close(fd) == -1 || rename(tmp_pathname, pathname) == -1) {
+		int error = errno;
+		unlink(tmp_pathname);
+		free(tmp_pathname);
+		errno = error;
+		return -1;
+	}
+	free(tmp_pathname);
+
+	// Make sure the rename itself is on disk too.
+	char  *slash   = strrchr(pathname, '/');
+	char  *dirname = slash == NULL ? strdup(".") : strndup(pathname, MAX(slash - pathname, 1));
+	int    dir_fd  = dirname == NULL ? -1 : open(dirname, O_RDONLY);
+	free(dirname);
+	if (dir_fd != -1) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	return 0;
+}
+
+static void *file_save_run(void *arg)
+{
+	struct file_save *save = arg;
+
+	save->error = file_save_write(save->snapshot, save->pathname) == -1 ? errno : 0;
+
+	char done = 0;
+	write(save->done_pipe[1], &done, 1);
+	return NULL;
+}
+
+// Start saving the file in the background. Returns -1 with errno set to EBUSY
+// if a save is already running.
+int file_save_start(struct file_save *save, struct file_buffer *file)
+{
+	if (save->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	save->snapshot = rope_copy(file->rope);
+	save->pathname = file->pathname;
+	if (save->snapshot == NULL) {
+		return -1;
+	}
+
+	int error = pthread_create(&save->thread, NULL, file_save_run, save);
+	if (error != 0) {
+		rope_free(save->snapshot);
+		errno = error;
+		return -1;
+	}
+
+	save->running = true;
+	return 0;
+}
+
+// Wait for the running save to finish, and clean up after it. This happens on
+// the editor's thread, since freeing the snapshot can touch state it shares
+// with the document. Returns -1 with errno set if the save failed.
+int file_save_finish(struct file_save *save)
+{
+	pthread_join(save->thread, NULL);
+	rope_free(save->snapshot);
+	save->running = false;
+
+	char done;
+	read(save->done_pipe[0], &done, 1);
+
+	if (save->error != 0) {
+		errno = save->error;
+		return -1;
+	}
+	return 0;
+}
+
+void file_save_cleanup(struct file_save *save)
+{
+	if (save->running) {
+		file_save_finish(save);
+	}
+	close(save->done_pipe[0]);
+	close(save->done_pipe[1]);
+}
+
+// A search of every file under a directory, run on a pool of threads. Each
+// thread has its own queue of directories and files to search, and steals from
+// the others' queues when its own runs out. The hits in each file are added to
+// the results once the file is done, so they show up while the search runs.
+struct grep_hit {
+	char  *path;
+	size_t line; // Counting from 1.
+	char  *text;
+	int    text_len;
+};
+
+struct grep_task {
+	char *path;
+	bool  dir;
+};
+
+// A thread's queue. The thread takes the newest task from the back, so it
+// works through the tree depth first, and other threads steal the oldest from
+// the front, which are likely to be directories with plenty of work in them.
+struct grep_queue {
+	pthread_mutex_t	  lock;
+	struct grep_task *tasks;
+	size_t		  head;
+	size_t		  tail;
+	size_t		  size;
+};
+
+struct grep_worker {
+	struct grep *grep;
+	int	     index;
+};
+
+struct grep {
+	re	 *re;
+	bool	  running;
+	int	  num_threads;
+	pthread_t threads[REGEX_MAX_THREADS];
+
+	struct grep_worker workers[REGEX_MAX_THREADS];
+	struct grep_queue  queues[REGEX_MAX_THREADS];
+
+	// The number of tasks queued or being worked on. The search is over when
+	// this gets to 0, as tasks are only added by other tasks.
+	atomic_long pending;
+	atomic_int  threads_left;
+	atomic_bool stop;
+
+	// Threads which run out of tasks sleep on idle_cond until one is queued or
+	// the search is over. queued is the number of tasks waiting in the queues.
+	atomic_long	queued;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t	idle_cond;
+
+	// The results so far, which threads add to as they finish files.
+	pthread_mutex_t	  lock;
+	struct grep_hit **hits;
+	size_t		  num_hits;
+	size_t		  hits_size;
+	size_t		  num_files;
+
+	// A byte is written here when there are new hits, and when the search is
+	// done, to wake up the main loop.
+	int notify_pipe[2];
+};
+
+// A search stops once it has found this many hits.
+#ifndef GREP_MAX_HITS
+#define GREP_MAX_HITS 100000
+#endif
+
+// How much of each matching line is kept to show.
+#define GREP_LINE_MAX 200
+
+// Files with a zero byte this near the start are taken to be binary and skipped.
+#define GREP_BINARY_CHECK 4096
+
+// Files are scanned this much at a time, so a search can be stopped partway
+// through a large one.
+#define GREP_SLICE_SIZE (1024 * 1024)
+
+int  grep_init(struct grep *grep);
+int  grep_start(struct grep *grep, re *re, const char *root);
+bool grep_poll(struct grep *grep);
+void grep_stop(struct grep *grep);
+void grep_render_to_context(struct grep *grep, struct render_context *ctx, struct bounds *bounds, size_t top,
+			    size_t selected);
+void grep_cleanup(struct grep *grep);
+
+int grep_init(struct grep *grep)
+{
+	grep->running = false;
+	pthread_mutex_init(&grep->lock, NULL);
+	pthread_mutex_init(&grep->idle_lock, NULL);
+	pthread_cond_init(&grep->idle_cond, NULL);
+	for (int i = 0; i < REGEX_MAX_THREADS; i++) {
+		pthread_mutex_init(&grep->queues[i].lock, NULL);
+	}
+	if (pipe(grep->notify_pipe) == -1) {
+		return -1;
+	}
+
+	// Threads mustn't block on a full pipe. One byte waiting is enough.
+	fcntl(grep->notify_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(grep->notify_pipe[0], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+static void grep_notify(struct grep *grep)
+{
+	char byte = 0;
+	write(grep->notify_pipe[1], &byte, 1);
+}
+
+// Wake up idle threads: one if there's a new task, or all of them if the search
+// is over.
+static void grep_wake(struct grep *grep, bool all)
+{
+	pthread_mutex_lock(&grep->idle_lock);
+	if (all) {
+		pthread_cond_broadcast(&grep->idle_cond);
+	}
+	else {
+		pthread_cond_signal(&grep->idle_cond);
+	}
+	pthread_mutex_unlock(&grep->idle_lock);
+}
+
+static int grep_push(struct grep *grep, int index, char *path, bool dir)
+{
+	struct grep_queue *q = &grep->queues[index];
+	pthread_mutex_lock(&q->lock);
+
+	if (q->tail == q->size) {
+		if (q->head > 0) {
+			memmove(q->tasks, &q->tasks[q->head], (q->tail - q->head) * sizeof(struct grep_task));
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		else {
+			size_t		  size	= q->size ? q->size * 2 : 64;
+			struct grep_task *tasks = realloc(q->tasks, size * sizeof(struct grep_task));
+			if (tasks == NULL) {
+				pthread_mutex_unlock(&q->lock);
+				return -1;
+			}
+			q->tasks = tasks;
+			q->size	 = size;
+		}
+	}
+	q->tasks[q->tail++] = (struct grep_task){.path = path, .dir = dir};
+	atomic_fetch_add(&grep->pending, 1);
+	atomic_fetch_add(&grep->queued, 1);
+
+	pthread_mutex_unlock(&q->lock);
+	grep_wake(grep, false);
+	return 0;
+}
+
+// Take a task from the back of a thread's own queue, or failing that from the
+// front of another's.
+static bool grep_pop(struct grep *grep, int index, struct grep_task *task)
+{
+	for (int i = 0; i < grep->num_threads; i++) {
+		struct grep_queue *q	 = &grep->queues[(index + i) % grep->num_threads];
+		bool		   found = false;
+
+		pthread_mutex_lock(&q->lock);
+		if (q->head < q->tail) {
+			*task = i == 0 ? q->tasks[--q->tail] : q->tasks[q->head++];
+			found = true;
+		}
+		pthread_mutex_unlock(&q->lock);
+
+		if (found) {
+			atomic_fetch_sub(&grep->queued, 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+static char *grep_join_path(const char *dir, const char *name)
+{
+	// Paths under the current directory are shown without a ./ in front.
+	if (strcmp(dir, ".") == 0) {
+		return strdup(name);
+	}
+	size_t len  = strlen(dir) + 1 + strlen(name) + 1;
+	char  *path = malloc(len);
+	if (path != NULL) {
+		snprintf(path, len, "%s/%s", dir, name);
+	}
+	return path;
+}
+
+// Queue up everything in a directory. Hidden files and directories (such as
+// .git) are skipped, and symbolic links aren't followed, so the walk can't go
+// round in circles.
+static void grep_dir(struct grep *grep, int index, const char *path)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL && !atomic_load(&grep->stop)) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char *child = grep_join_path(path, entry->d_name);
+		if (child == NULL) {
+			continue;
+		}
+
+		int type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (lstat(child, &st) == 0) {
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+		}
+		if ((type != DT_DIR && type != DT_REG) || grep_push(grep, index, child, type == DT_DIR) == -1) {
+			free(child);
+		}
+	}
+	closedir(dir);
+}
+
+static struct grep_hit *grep_hit_new(const char *path, size_t line, const uint8_t *text, size_t text_len)
+{
+	size_t		 path_len = strlen(path);
+	struct grep_hit *hit	  = malloc(sizeof(struct grep_hit) + path_len + 1 + text_len);
+	if (hit == NULL) {
+		return NULL;
+	}
+	hit->path     = (char *)(hit + 1);
+	hit->line     = line;
+	hit->text     = hit->path + path_len + 1;
+	hit->text_len = text_len;
+	memcpy(hit->path, path, path_len + 1);
+
+	// Control characters (tabs included) would upset the display.
+	for (size_t i = 0; i < text_len; i++) {
+		hit->text[i] = text[i] < 0x20 || text[i] == 0x7f ? ' ' : text[i];
+	}
+	return hit;
+}
+
+// Add the hits found in a file to the results. Returns false if the search
+// should stop, as there are enough.
+static bool grep_add_hits(struct grep *grep, struct grep_hit **hits, size_t num_hits)
+{
+	pthread_mutex_lock(&grep->lock);
+
+	size_t n = MIN(num_hits, GREP_MAX_HITS - grep->num_hits);
+	if (grep->num_hits + n > grep->hits_size) {
+		size_t		  size	  = MAX(grep->hits_size * 2, grep->num_hits + n);
+		struct grep_hit **grown = realloc(grep->hits, size * sizeof(struct grep_hit *));
+		if (grown == NULL) {
+			n = 0;
+		}
+		else {
+			grep->hits	= grown;
+			grep->hits_size = size;
+		}
+	}
+	if (n > 0) {
+		memcpy(&grep->hits[grep->num_hits], hits, n * sizeof(struct grep_hit *));
+		grep->num_hits += n;
+	}
+	grep->num_files++;
+	bool more = grep->num_hits < GREP_MAX_HITS;
+
+	pthread_mutex_unlock(&grep->lock);
+
+	for (size_t i = n; i < num_hits; i++) {
+		free(hits[i]);
+	}
+	if (n > 0) {
+		grep_notify(grep);
+	}
+	return more;
+}
+
+// Find the lines in a file which match. The file is mapped rather than read,
+// and scanned a line at a time like a regex search in the editor.
+static void grep_file(struct grep *grep, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	size_t	       size = st.st_size;
+	const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return;
+	}
+	if (memchr(data, 0, MIN(size, GREP_BINARY_CHECK)) != NULL) {
+		munmap((void *)data, size);
+		return;
+	}
+
+	struct grep_hit **hits	    = NULL;
+	size_t		  num_hits  = 0;
+	size_t		  hits_size = 0;
+	size_t		  line	    = 1;
+	size_t		  counted   = 0;
+	size_t		  ofs	    = 0;
+	size_t		  scanned   = 0;
+	re_state	  state	    = re_scan_start(grep->re, true);
+
+	while (num_hits < GREP_MAX_HITS && !atomic_load(&grep->stop)) {
+		size_t end;
+		if (scanned == size) {
+			// Only a last line without a newline can match at the very end.
+			if (data[size - 1] == '\n' || !re_scan_finish(grep->re, state)) {
+				break;
+			}
+			end = size;
+		}
+		else {
+			size_t n = MIN(size - scanned, GREP_SLICE_SIZE);
+			if (!re_scan(grep->re, &state, &data[scanned], n, &end)) {
+				scanned += n;
+				continue;
+			}
+			end += scanned;
+		}
+
+		// ofs is at the start of a line, but lines after it may have been
+		// scanned before the one which matched.
+		size_t start = end;
+		while (start > ofs && data[start - 1] != '\n') {
+			start--;
+		}
+		for (const uint8_t *p = &data[counted]; (p = memchr(p, '\n', &data[start] - p)) != NULL; p++) {
+			line++;
+		}
+		counted = start;
+
+		if (num_hits == hits_size) {
+			hits_size		= hits_size ? hits_size * 2 : 16;
+			struct grep_hit **grown = realloc(hits, hits_size * sizeof(struct grep_hit *));
+			if (grown == NULL) {
+				break;
+			}
+			hits = grown;
+		}
+		const uint8_t *nl	= memchr(&data[end], '\n', size - end);
+		size_t	       line_len = (nl != NULL ? (size_t)(nl - data) : size) - start;
+		hits[num_hits]		= grep_hit_new(path, line, &data[start], MIN(line_len, GREP_LINE_MAX));
+		if (hits[num_hits] != NULL) {
+			num_hits++;
+		}
+
+		if (nl == NULL) {
+			break;
+		}
+		ofs = scanned = nl - data + 1;
+		state	      = re_scan_start(grep->re, true);
+	}
+	munmap((void *)data, size);
+
+	if (!grep_add_hits(grep, hits, num_hits)) {
+		atomic_store(&grep->stop, true);
+	}
+	free(hits);
+}
+
+static void *grep_run(void *arg)
+{
+	struct grep_worker *worker = arg;
+	struct grep	   *grep   = worker->grep;
+
+	while (!atomic_load(&grep->stop) && atomic_load(&grep->pending) > 0) {
+		struct grep_task task;
+		if (!grep_pop(grep, worker->index, &task)) {
+			// Others are still working, and may queue up more.
+			pthread_mutex_lock(&grep->idle_lock);
+			while (!atomic_load(&grep->stop) && atomic_load(&grep->pending) > 0 &&
+			       atomic_load(&grep->queued) == 0) {
+				pthread_cond_wait(&grep->idle_cond, &grep->idle_lock);
+			}
+			pthread_mutex_unlock(&grep->idle_lock);
+			continue;
+		}
+		if (task.dir) {
+			grep_dir(grep, worker->index, task.path);
+		}
+		else {
+			grep_file(grep, task.path);
+		}
+		free(task.path);
+		if (atomic_fetch_sub(&grep->pending, 1) == 1) {
+			grep_wake(grep, true);
+		}
+	}
+
+	if (atomic_fetch_sub(&grep->threads_left, 1) == 1) {
+		grep_notify(grep);
+	}
+	return NULL;
+}
+
+static void grep_clear(struct grep *grep)
+{
+	for (size_t i = 0; i < grep->num_hits; i++) {
+		free(grep->hits[i]);
+	}
+	grep->num_hits	= 0;
+	grep->num_files = 0;
+	re_free(grep->re);
+	grep->re = NULL;
+}
+
+// Start searching the files under root for re, which the search takes over.
+// The results of the last search are thrown away.
+int grep_start(struct grep *grep, re *re, const char *root)
+{
+	grep_stop(grep);
+	grep_clear(grep);
+	grep->re = re;
+
+	char *path = strdup(root);
+	if (path == NULL) {
+		return -1;
+	}
+	long num_cpus	  = sysconf(_SC_NPROCESSORS_ONLN);
+	grep->num_threads = MIN(MAX(num_cpus, 1), REGEX_MAX_THREADS);
+	atomic_store(&grep->pending, 0);
+	atomic_store(&grep->queued, 0);
+	atomic_store(&grep->stop, false);
+	if (grep_push(grep, 0, path, true) == -1) {
+		free(path);
+		return -1;
+	}
+
+	atomic_store(&grep->threads_left, grep->num_threads);
+	for (int i = 0; i < grep->num_threads; i++) {
+		grep->workers[i] = (struct grep_worker){.grep = grep, .index = i};
+		int error	 = pthread_create(&grep->threads[i], NULL, grep_run, &grep->workers[i]);
+		if (error != 0) {
+			// Carry on with the threads we have, if any.
+			atomic_fetch_sub(&grep->threads_left, grep->num_threads - i);
+			grep->num_threads = i;
+			if (i == 0) {
+				free(path);
+				grep->queues[0].head = grep->queues[0].tail = 0;
+				errno = error;
+				return -1;
+			}
+			break;
+		}
+	}
+	grep->running = true;
+	return 0;
+}
+
+// Check on a running search once grep->notify_pipe becomes readable. Returns
+// true once it has finished.
+bool grep_poll(struct grep *grep)
+{
+	char buf[64];
+	while (read(grep->notify_pipe[0], buf, sizeof(buf)) > 0) {
+	}
+	if (atomic_load(&grep->threads_left) > 0) {
+		return false;
+	}
+	grep_stop(grep);
+	return true;
+}
+
+// Stop the running search, if there is one. The hits found so far are kept.
+void grep_stop(struct grep *grep)
+{
+	if (!grep->running) {
+		return;
+	}
+	atomic_store(&grep->stop, true);
+	grep_wake(grep, true);
+	for (int i = 0; i < grep->num_threads; i++) {
+		pthread_join(grep->threads[i], NULL);
+
+		// Throw away what's left.
+		struct grep_queue *q = &grep->queues[i];
+		for (size_t j = q->head; j < q->tail; j++) {
+			free(q->tasks[j].path);
+		}
+		q->head = q->tail = 0;
+	}
+	grep->running = false;
+}
+
+// Draw the hits from top on, one to a row, with the selected one marked and
+// in reverse video.
+void grep_render_to_context(struct grep *grep, struct render_context *ctx, struct bounds *bounds, size_t top,
+			    size_t selected)
+{
+	pthread_mutex_lock(&grep->lock);
+
+	for (int row = 0; row < bounds->height && top + row < grep->num_hits; row++) {
+		int screen_row = bounds->row + row;
+		if (screen_row < 0 || screen_row >= ctx->rows) {
+			continue;
+		}
+
+		struct grep_hit *hit = grep->hits[top + row];
+		char		 buf[PATH_MAX + GREP_LINE_MAX + 32];
+		int		 len = snprintf(buf, sizeof(buf), "%c %s:%zu: %.*s", top + row == selected ? '>' : ' ',
+						hit->path, hit->line, hit->text_len, hit->text);
+		len		     = MIN(len, (int)sizeof(buf) - 1);
+
+		render_context_put_text(ctx, screen_row, bounds->col, bounds->col + bounds->width, buf, len);
+		if (top + row == selected) {
+			render_context_set_attrs(ctx, screen_row, bounds->col, bounds->width, RENDER_ATTR_REVERSE);
+		}
+	}
+
+	pthread_mutex_unlock(&grep->lock);
+}
+
+void grep_cleanup(struct grep *grep)
+{
+	grep_stop(grep);
+	grep_clear(grep);
+	free(grep->hits);
+	for (int i = 0; i < REGEX_MAX_THREADS; i++) {
+		free(grep->queues[i].tasks);
+		pthread_mutex_destroy(&grep->queues[i].lock);
+	}
+	pthread_mutex_destroy(&grep->lock);
+	pthread_mutex_destroy(&grep->idle_lock);
+	pthread_cond_destroy(&grep->idle_cond);
+	close(grep->notify_pipe[0]);
+	close(grep->notify_pipe[1]);
+}
+
+struct status_line {
+	char *mode;
+	int   mode_len;
+	char *file;
+	int   file_len;
+	char  message[64];
+	int   message_len;
+	int   cursor_row;
+	int   cursor_col;
+};
+
+void status_line_render_to_context(struct status_line *sl, struct render_context *ctx, struct bounds *bounds)
+{
+	// Only render if we have at least one row in the bounds
+	if (bounds->height < 1) {
+		return;
+	}
+
+	int screen_row = bounds->row;
+
+	// Skip if the status line row is outside screen bounds
+	if (screen_row < 0 || screen_row >= ctx->rows) {
+		return;
+	}
+
+	// The status line is a bar in reverse video, with the mode in bold.
+	render_context_set_attrs(ctx, screen_row, bounds->col, bounds->width, RENDER_ATTR_REVERSE);
+	render_context_set_attrs(ctx, screen_row, bounds->col, MIN(sl->mode_len, bounds->width),
+				 RENDER_ATTR_REVERSE | RENDER_ATTR_BOLD);
+
+	int end = bounds->col + bounds->width;
+	int col = render_context_put_text(ctx, screen_row, bounds->col, end, sl->mode, sl->mode_len);
+
+	// The mode, filename and message are 4 spaces apart.
+	col = render_context_put_text(ctx, screen_row, col + 4, end, sl->file, sl->file_len);
+	render_context_put_text(ctx, screen_row, col + 4, end, sl->message, sl->message_len);
+
+	// Prepare cursor position string
+	char str[32] = {};
+	int  str_len = snprintf(str, sizeof(str), "%d,%d", sl->cursor_row, sl->cursor_col);
+
+	// Right align cursor position within the bounds
+	render_context_put_text(ctx, screen_row, MAX(end - str_len, bounds->col), end, str, str_len);
+}
+
+// The most input read from the terminal at once.
+#define EDITOR_INPUT_SIZE 65536
+
+// Line numbers typed after : can be at most this many digits, so they always
+// fit in a size_t.
+#define EDITOR_GOTO_SIZE 19
+
+// Frames are drawn at most this often (in nanoseconds), which is about the
+// refresh rate of most displays.
+#define EDITOR_FRAME_INTERVAL (1000000000 / 60)
+
+// The search being typed after /. The query is kept afterwards for n.
+struct editor_search {
+	char query[SEARCH_QUERY_SIZE];
+	int  query_len;
+
+	// Where the cursor was when the search started.
+	size_t origin;
+
+	// matches[i] is where the first i bytes of the query were found, or -1 if
+	// they weren't (matches[0] isn't used). A longer query can only match at or after where a shorter
+	// one did, so typing searches on from the last match, and backspacing
+	// doesn't need to search at all.
+	ssize_t matches[SEARCH_QUERY_SIZE + 1];
+};
+
+// The regex typed after ?, or after ^P for a project search. The last ? one
+// is kept compiled afterwards for n.
+struct editor_regex {
+	char pattern[SEARCH_QUERY_SIZE];
+	int  pattern_len;
+	re  *re;
+	bool project;
+
+	// Whether n repeats this search rather than the last / one.
+	bool repeat;
+};
+
+struct editor {
+	struct terminal_config term;
+	struct render_context  render_ctx;
+	struct file_buffer     file_buffer;
+	struct editor_state    state;
+	struct bounds	       file_buffer_bounds;
+	struct bounds	       status_line_bounds;
+	struct status_line     status_line;
+	struct file_save       save;
+	struct editor_search   search;
+	struct editor_regex    regex;
+	struct grep	       grep;
+
+	// The project search hit picked out in the results, and the one shown at
+	// the top.
+	size_t grep_selected;
+	size_t grep_top;
+
+	// The line number being typed after :.
+	char goto_line[EDITOR_GOTO_SIZE];
+	int  goto_line_len;
+
+	// Input which has been read but not handled yet. Between reads this only
+	// holds the start of an escape sequence or a character cut in two.
+	char input[EDITOR_INPUT_SIZE];
+	int  input_len;
+
+	// Whether we're between the markers of a bracketed paste.
+	bool pasting;
+
+	// Whether the text has changed since the last frame was drawn, or just the
+	// cursor has moved.
+	bool	 dirty;
+	bool	 cursor_moved;
+	uint64_t last_frame;
+};
+
+int  editor_init(struct editor *ed, char *pathname);
+void editor_render(struct editor *ed);
+bool editor_frame_pending(struct editor *ed);
+void editor_present(struct editor *ed);
+void editor_present_if_due(struct editor *ed);
+bool editor_handle_key(struct editor *ed, char c);
+void editor_search_key(struct editor *ed, char c);
+void editor_regex_key(struct editor *ed, char c);
+void editor_regex_next(struct editor *ed);
+void editor_grep_key(struct editor *ed, char c);
+void editor_grep_update(struct editor *ed);
+void editor_goto_key(struct editor *ed, char c);
+bool editor_handle_input(struct editor *ed);
+void editor_save(struct editor *ed);
+void editor_save_done(struct editor *ed);
+void editor_cleanup(struct editor *ed);
+
+// Set up the editor's windows for a terminal of ed->term's size. Output goes to
+// ed->term.fd, which doesn't have to be a terminal.
+int editor_init(struct editor *ed, char *pathname)
+{
+	struct terminal_config *term = &ed->term;
+
+	if (render_context_init(&ed->render_ctx, term->window_rows, term->window_cols) == -1) {
+		return -1;
+	}
+
+	if (file_buffer_init_from_file(&ed->file_buffer, pathname) == -1) {
+		file_buffer_cleanup(&ed->file_buffer);
+		render_context_cleanup(&ed->render_ctx);
+		return -1;
+	}
+
+	if (file_save_init(&ed->save) == -1) {
+		file_buffer_cleanup(&ed->file_buffer);
+		render_context_cleanup(&ed->render_ctx);
+		return -1;
+	}
+
+	if (grep_init(&ed->grep) == -1) {
+		file_save_cleanup(&ed->save);
+		file_buffer_cleanup(&ed->file_buffer);
+		render_context_cleanup(&ed->render_ctx);
+		return -1;
+	}
+
+	ed->state.mode = EDITOR_MODE_NORMAL;
+
+	ed->file_buffer_bounds.col    = 0;
+	ed->file_buffer_bounds.row    = 0;
+	ed->file_buffer_bounds.width  = term->window_cols;
+	ed->file_buffer_bounds.height = term->window_rows - 2;
+
+	ed->status_line_bounds.col    = 0;
+	ed->status_line_bounds.row    = term->window_rows - 2;
+	ed->status_line_bounds.width  = term->window_cols;
+	ed->status_line_bounds.height = 1;
+
+	ed->status_line.mode	   = "NORMAL";
+	ed->status_line.mode_len   = 6;
+	ed->status_line.file	   = ed->file_buffer.pathname;
+	ed->status_line.file_len   = strlen(ed->file_buffer.pathname);
+	ed->status_line.cursor_row = 10;
+	ed->status_line.cursor_col = 50;
+
+	return 0;
+}
+
+void editor_render(struct editor *ed)
+{
+	int cursor_row = ed->file_buffer.cursor_row;
+	int cursor_col = ed->file_buffer.cursor_col;
+
+	render_context_clear(&ed->render_ctx);
+	if (ed->state.mode == EDITOR_MODE_GREP) {
+		grep_render_to_context(&ed->grep, &ed->render_ctx, &ed->file_buffer_bounds, ed->grep_top,
+				       ed->grep_selected);
+		cursor_row = ed->file_buffer_bounds.row + (ed->grep_selected - ed->grep_top);
+		cursor_col = ed->file_buffer_bounds.col;
+	}
+	else {
+		file_buffer_render_to_context(&ed->file_buffer, &ed->render_ctx, &ed->file_buffer_bounds);
+	}
+	status_line_render_to_context(&ed->status_line, &ed->render_ctx, &ed->status_line_bounds);
+	render_context_render(&ed->render_ctx, ed->term.fd, cursor_row, cursor_col);
+
+	ed->dirty	 = false;
+	ed->cursor_moved = false;
+	ed->last_frame	 = now_ns();
+}
+
+// Whether there's anything to show. A paste in progress isn't shown until it's
+// all there.
+bool editor_frame_pending(struct editor *ed) { return (ed->dirty || ed->cursor_moved) && !ed->pasting; }
+
+// Show the changes made since the last frame: the whole screen if the text has
+// changed, otherwise just the cursor.
+void editor_present(struct editor *ed)
+{
+	if (ed->dirty) {
+		editor_render(ed);
+		return;
+	}
+	if (ed->cursor_moved) {
+		terminal_place_cursor(&ed->term, ed->file_buffer.cursor_row, ed->file_buffer.cursor_col);
+		ed->cursor_moved = false;
+		ed->last_frame	 = now_ns();
+	}
+}
+
+// Show the changes made since the last frame if it was at least
+// EDITOR_FRAME_INTERVAL ago.
+void editor_present_if_due(struct editor *ed)
+{
+	if (editor_frame_pending(ed) && now_ns() - ed->last_frame >= EDITOR_FRAME_INTERVAL) {
+		editor_present(ed);
+	}
+}
+
+// Show a message in the status line until the next one.
+static void editor_set_message(struct editor *ed, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(ed->status_line.message, sizeof(ed->status_line.message), fmt, args);
+	va_end(args);
+
+	ed->status_line.message_len = MIN(MAX(len, 0), (int)sizeof(ed->status_line.message) - 1);
+	ed->dirty		    = true;
+}
+
+// Start saving the file in the background. The editor carries on as normal
+// until editor_save_done is called once ed->save.done_pipe becomes readable.
+void editor_save(struct editor *ed)
+{
+	if (file_save_start(&ed->save, &ed->file_buffer) == -1) {
+		editor_set_message(ed, "save failed: %s", strerror(errno));
+		return;
+	}
+	editor_set_message(ed, "saving...");
+}
+
+void editor_save_done(struct editor *ed)
+{
+	if (file_save_finish(&ed->save) == -1) {
+		editor_set_message(ed, "save failed: %s", strerror(errno));
+		return;
+	}
+	editor_set_message(ed, "saved");
+}
+
+// Handle a single key press. Returns true if the editor should exit.
+bool editor_handle_key(struct editor *ed, char c)
+{
+	struct file_buffer *file	 = &ed->file_buffer;
+	struct bounds	   *bounds	 = &ed->file_buffer_bounds;
+	size_t		    top_line	 = file->top_line;
+	int		    top_line_row = file->top_line_row;
+
+	if (c == KEY_CTRL('s')) {
+		editor_save(ed);
+		return false;
+	}
+
+	if (ed->state.mode == EDITOR_MODE_NORMAL) {
+		switch (c) {
+		case 'h':
+			file_buffer_move_cursor_prev_char(file, bounds);
+			ed->cursor_moved = true;
+			break;
+		case 'j':
+			file_buffer_move_cursor_next_line(file, bounds);
+			ed->cursor_moved = true;
+			break;
+		case 'k':
+			file_buffer_move_cursor_prev_line(file, bounds);
+			ed->cursor_moved = true;
+			break;
+		case 'l':
+			file_buffer_move_cursor_next_char(file, bounds);
+			ed->cursor_moved = true;
+			break;
+		case KEY_CTRL('f'):
+		case KEY_CTRL('b'):
+			file_buffer_page(file, bounds, c == KEY_CTRL('f'));
+			ed->cursor_moved = true;
+			break;
+		case ':':
+			ed->state.mode	  = EDITOR_MODE_GOTO;
+			ed->goto_line_len = 0;
+			editor_set_message(ed, ":");
+			break;
+		case 'i':
+			ed->state.mode = EDITOR_MODE_INSERT;
+			write(ed->term.fd, TERMINAL_CURSOR_BAR);
+			break;
+		case '/':
+			ed->state.mode	     = EDITOR_MODE_SEARCH;
+			ed->search.query_len = 0;
+			ed->search.origin    = file->cursor_pos;
+			editor_set_message(ed, "/");
+			break;
+		case '?':
+		case KEY_CTRL('p'):
+			ed->state.mode	      = EDITOR_MODE_REGEX;
+			ed->regex.pattern_len = 0;
+			ed->regex.project     = c == KEY_CTRL('p');
+			editor_set_message(ed, ed->regex.project ? "grep " : "?");
+			break;
+		case 'n':
+			if (ed->regex.repeat) {
+				editor_regex_next(ed);
+				break;
+			}
+			if (ed->search.query_len == 0) {
+				editor_set_message(ed, "no previous search");
+				break;
+			}
+			ssize_t match = file_buffer_find_next(file, file->cursor_pos, ed->search.query, ed->search.query_len);
+			if (match == -1) {
+				editor_set_message(ed, "not found: %.*s", ed->search.query_len, ed->search.query);
+				break;
+			}
+			file->cursor_pos = match;
+			file_buffer_update_cursor_coords(file, bounds);
+			ed->cursor_moved = true;
+			break;
+		case 'u':
+			if (!file_buffer_undo(file, bounds)) {
+				editor_set_message(ed, "nothing to undo");
+			}
+			ed->dirty = true;
+			break;
+		case KEY_CTRL('r'):
+			if (!file_buffer_redo(file, bounds)) {
+				editor_set_message(ed, "nothing to redo");
+			}
+			ed->dirty = true;
+			break;
+		case 'q':
+			return true;
+		}
+	}
+	else if (ed->state.mode == EDITOR_MODE_SEARCH) {
+		editor_search_key(ed, c);
+	}
+	else if (ed->state.mode == EDITOR_MODE_REGEX) {
+		editor_regex_key(ed, c);
+	}
+	else if (ed->state.mode == EDITOR_MODE_GREP) {
+		editor_grep_key(ed, c);
+	}
+	else if (ed->state.mode == EDITOR_MODE_GOTO) {
+		editor_goto_key(ed, c);
+	}
+	else {
+		switch (c) {
+		case '\e':
+			// Everything typed since entering insert mode is undone together.
+			undo_history_break(&file->history);
+			ed->state.mode = EDITOR_MODE_NORMAL;
+			write(ed->term.fd, TERMINAL_CURSOR_BLOCK);
+			break;
+		case 127:
+			file_buffer_delete(file, bounds);
+			break;
+		default:
+			file_buffer_insert(file, &c, 1);
+			break;
+		}
+
+		file_buffer_update_cursor_coords(file, bounds);
+		ed->dirty = true;
+	}
+
+	// Moving the cursor off the screen scrolls it, which needs a whole frame.
+	if (file->top_line != top_line || file->top_line_row != top_line_row) {
+		ed->dirty = true;
+	}
+
+	return false;
+}
+
+// Get the length of the longest proper prefix of marker which str ends with.
+static int ends_with_prefix(const char *str, int len, const char *marker)
+{
+	for (int n = MIN(len, TERMINAL_PASTE_MARKER_LEN - 1); n > 0; n--) {
+		if (memcmp(&str[len - n], marker, n) == 0) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+// Get the number of bytes at the end of str which make up an incomplete character.
+static int incomplete_char_len(const char *str, int len)
+{
+	for (int n = 1; n <= MIN(len, 6); n++) {
+		uint8_t byte = str[len - n];
+		if ((byte & 0xc0) != 0x80) {
+			size_t size = utf8_codepoint_size(byte);
+			return size != SIZE_MAX && size > (size_t)n ? n : 0;
+		}
+	}
+	return 0;
+}
+
+// Move the cursor to where the query was found, or back to where the search
+// started if it wasn't.
+static void editor_search_show(struct editor *ed)
+{
+	struct editor_search *search = &ed->search;
+	ssize_t		      match  = search->query_len > 0 ? search->matches[search->query_len] : -1;
+
+	ed->file_buffer.cursor_pos = match != -1 ? (size_t)match : search->origin;
+	file_buffer_update_cursor_coords(&ed->file_buffer, &ed->file_buffer_bounds);
+	editor_set_message(ed, "/%.*s", search->query_len, search->query);
+}
+
+// Add a byte to the query, and search for the query as it now stands.
+static void editor_search_append(struct editor *ed, char c)
+{
+	struct editor_search *search = &ed->search;
+	if (search->query_len == SEARCH_QUERY_SIZE) {
+		return;
+	}
+
+	// Matches are looked for after the cursor, and then from the start of the
+	// file up to it.
+	ssize_t total = rope_char_count(ed->file_buffer.rope);
+	ssize_t start = MIN((ssize_t)search->origin + 1, total);
+	ssize_t prev  = search->query_len > 0 ? search->matches[search->query_len] : start;
+
+	search->query[search->query_len++] = c;
+
+	ssize_t match = prev;
+	if (prev != -1 && incomplete_char_len(search->query, search->query_len) == 0) {
+		if (prev >= start) {
+			match = file_buffer_find(&ed->file_buffer, prev, total, search->query, search->query_len);
+			if (match == -1) {
+				prev = 0;
+			}
+		}
+		if (prev < start) {
+			match = file_buffer_find(&ed->file_buffer, prev, start, search->query, search->query_len);
+		}
+	}
+	search->matches[search->query_len] = match;
+	editor_search_show(ed);
+}
+
+// Handle a key typed while searching. Enter leaves the cursor on the match, and
+// escape puts it back where it was.
+void editor_search_key(struct editor *ed, char c)
+{
+	struct editor_search *search = &ed->search;
+
+	switch (c) {
+	case '\r':
+	case '\n':
+		ed->state.mode	 = EDITOR_MODE_NORMAL;
+		ed->regex.repeat = false;
+		if (search->matches[search->query_len] == -1) {
+			editor_set_message(ed, "not found: %.*s", search->query_len, search->query);
+		}
+		else {
+			editor_set_message(ed, "/%.*s", search->query_len, search->query);
+		}
+		break;
+	case '\e':
+		ed->state.mode	  = EDITOR_MODE_NORMAL;
+		search->query_len = 0;
+		editor_search_show(ed);
+		editor_set_message(ed, "");
+		break;
+	case 127:
+		if (search->query_len == 0) {
+			ed->state.mode = EDITOR_MODE_NORMAL;
+			editor_set_message(ed, "");
+			break;
+		}
+		// Take off a whole character.
+		do {
+			search->query_len--;
+		} while (search->query_len > 0 && (search->query[search->query_len] & 0xc0) == 0x80);
+		editor_search_show(ed);
+		break;
+	default:
+		editor_search_append(ed, c);
+		break;
+	}
+}
+
+// Move the cursor to the next match of the regex after it, wrapping around to
+// the start of the file, and say how many lines match.
+void editor_regex_next(struct editor *ed)
+{
+	struct file_buffer  *file  = &ed->file_buffer;
+	struct editor_regex *regex = &ed->regex;
+	size_t		     line  = rope_char_to_line(file->rope, file->cursor_pos);
+
+	// Matches on the cursor's line are looked for separately, so the search
+	// only needs to find the next line with one.
+	size_t after = rope_char_count(file->rope) + 1;
+	if (line + 1 < rope_line_count(file->rope)) {
+		after = rope_line_to_char(file->rope, line + 1);
+	}
+	struct regex_result result;
+	if (file_buffer_regex_search(file, regex->re, after, &result) == -1) {
+		editor_set_message(ed, "search failed: %s", strerror(errno));
+		return;
+	}
+
+	ssize_t match = file_buffer_regex_match_line(file, regex->re, line, file->cursor_pos + 1);
+	ssize_t end   = result.next != -1 ? result.next : result.first;
+	if (match == -1 && end != -1) {
+		match = file_buffer_regex_match_line(file, regex->re, rope_char_to_line(file->rope, end), 0);
+	}
+	if (match == -1) {
+		editor_set_message(ed, "not found: %.*s", regex->pattern_len, regex->pattern);
+		return;
+	}
+
+	file->cursor_pos = match;
+	file_buffer_update_cursor_coords(file, &ed->file_buffer_bounds);
+	ed->cursor_moved = true;
+	editor_set_message(ed, "?%.*s: %zu lines", regex->pattern_len, regex->pattern, result.count);
+}
+
+// Show the regex being typed in the status line.
+static void editor_regex_show(struct editor *ed)
+{
+	struct editor_regex *regex = &ed->regex;
+	editor_set_message(ed, "%s%.*s", regex->project ? "grep " : "?", regex->pattern_len, regex->pattern);
+}
+
+static void editor_regex_append(struct editor *ed, char c)
+{
+	struct editor_regex *regex = &ed->regex;
+	if (regex->pattern_len < SEARCH_QUERY_SIZE) {
+		regex->pattern[regex->pattern_len++] = c;
+	}
+	editor_regex_show(ed);
+}
+
+// Search the files under the current directory, and show the hits as they come in.
+static void editor_grep_start(struct editor *ed, re *re)
+{
+	ed->grep_selected = 0;
+	ed->grep_top	  = 0;
+	if (grep_start(&ed->grep, re, ".") == -1) {
+		editor_set_message(ed, "grep failed: %s", strerror(errno));
+		return;
+	}
+	ed->state.mode = EDITOR_MODE_GREP;
+	editor_set_message(ed, "searching...");
+}
+
+// Handle a key typed while entering a regex. The search runs once it's
+// entered, rather than as it's typed, as each one reads the whole file.
+void editor_regex_key(struct editor *ed, char c)
+{
+	struct editor_regex *regex = &ed->regex;
+	const char	    *error;
+
+	switch (c) {
+	case '\r':
+	case '\n': {
+		ed->state.mode = EDITOR_MODE_NORMAL;
+		re *re	       = re_compile(regex->pattern, regex->pattern_len, &error);
+		if (re == NULL) {
+			editor_set_message(ed, "%s%.*s: %s", regex->project ? "grep " : "?", regex->pattern_len,
+					   regex->pattern, error);
+			break;
+		}
+		if (regex->project) {
+			editor_grep_start(ed, re);
+			break;
+		}
+		re_free(regex->re);
+		regex->re     = re;
+		regex->repeat = true;
+		editor_regex_next(ed);
+		break;
+	}
+	case '\e':
+		ed->state.mode = EDITOR_MODE_NORMAL;
+		editor_set_message(ed, "");
+		break;
+	case 127:
+		if (regex->pattern_len == 0) {
+			ed->state.mode = EDITOR_MODE_NORMAL;
+			editor_set_message(ed, "");
+			break;
+		}
+		do {
+			regex->pattern_len--;
+		} while (regex->pattern_len > 0 && (regex->pattern[regex->pattern_len] & 0xc0) == 0x80);
+		editor_regex_show(ed);
+		break;
+	default:
+		editor_regex_append(ed, c);
+		break;
+	}
+}
+
+// Open the selected project search hit in place of the file, with the cursor
+// at the start of its line.
+static void editor_grep_open(struct editor *ed)
+{
+	if (ed->save.running) {
+		editor_set_message(ed, "can't open a file while saving");
+		return;
+	}
+
+	// The hits don't change once the search has stopped.
+	grep_stop(&ed->grep);
+	struct grep_hit	  *hit	= ed->grep.hits[ed->grep_selected];
+	struct file_buffer file = {};
+	if (file_buffer_init_from_file(&file, hit->path) == -1) {
+		editor_set_message(ed, "open %s: %s", hit->path, strerror(errno));
+		file_buffer_cleanup(&file);
+		return;
+	}
+
+	file_buffer_cleanup(&ed->file_buffer);
+	ed->file_buffer		   = file;
+	ed->file_buffer.cursor_pos = rope_line_to_char(file.rope, hit->line - 1);
+	file_buffer_update_cursor_coords(&ed->file_buffer, &ed->file_buffer_bounds);
+
+	ed->status_line.file	 = ed->file_buffer.pathname;
+	ed->status_line.file_len = strlen(ed->file_buffer.pathname);
+	ed->state.mode		 = EDITOR_MODE_NORMAL;
+	editor_set_message(ed, "");
+}
+
+// Handle a key pressed in the project search results. j and k pick a hit, enter
+// opens it, and escape stops the search and goes back to the file.
+void editor_grep_key(struct editor *ed, char c)
+{
+	pthread_mutex_lock(&ed->grep.lock);
+	size_t num_hits = ed->grep.num_hits;
+	pthread_mutex_unlock(&ed->grep.lock);
+
+	switch (c) {
+	case 'j':
+		if (ed->grep_selected + 1 < num_hits) {
+			ed->grep_selected++;
+		}
+		break;
+	case 'k':
+		if (ed->grep_selected > 0) {
+			ed->grep_selected--;
+		}
+		break;
+	case '\r':
+	case '\n':
+		if (ed->grep_selected < num_hits) {
+			editor_grep_open(ed);
+		}
+		return;
+	case '\e':
+	case 'q':
+		grep_stop(&ed->grep);
+		ed->state.mode = EDITOR_MODE_NORMAL;
+		editor_set_message(ed, "");
+		return;
+	}
+
+	// Scroll to keep the selected hit on screen.
+	size_t height = MAX(ed->file_buffer_bounds.height, 1);
+	if (ed->grep_selected < ed->grep_top) {
+		ed->grep_top = ed->grep_selected;
+	}
+	else if (ed->grep_selected >= ed->grep_top + height) {
+		ed->grep_top = ed->grep_selected - height + 1;
+	}
+	ed->dirty = true;
+}
+
+// Show the hits which have come in since the last frame, once
+// ed->grep.notify_pipe becomes readable.
+void editor_grep_update(struct editor *ed)
+{
+	if (ed->state.mode == EDITOR_MODE_GREP) {
+		ed->dirty = true;
+	}
+	if (!grep_poll(&ed->grep)) {
+		return;
+	}
+	if (ed->grep.num_hits == GREP_MAX_HITS) {
+		editor_set_message(ed, "stopped after %zu hits", ed->grep.num_hits);
+	}
+	else {
+		editor_set_message(ed, "%zu hits, %zu files searched", ed->grep.num_hits, ed->grep.num_files);
+	}
+}
+
+// Show the line number being typed in the status line.
+static void editor_goto_show(struct editor *ed) { editor_set_message(ed, ":%.*s", ed->goto_line_len, ed->goto_line); }
+
+// Add a digit to the line number. Anything else is ignored.
+static void editor_goto_append(struct editor *ed, char c)
+{
+	if (c >= '0' && c <= '9' && ed->goto_line_len < EDITOR_GOTO_SIZE) {
+		ed->goto_line[ed->goto_line_len++] = c;
+	}
+	editor_goto_show(ed);
+}
+
+// Handle a key typed while entering a line number after :. Lines are counted
+// from 1, and ones past the end go to the last line.
+void editor_goto_key(struct editor *ed, char c)
+{
+	switch (c) {
+	case '\r':
+	case '\n': {
+		ed->state.mode = EDITOR_MODE_NORMAL;
+		editor_set_message(ed, "");
+		if (ed->goto_line_len == 0) {
+			break;
+		}
+		size_t line = 0;
+		for (int i = 0; i < ed->goto_line_len; i++) {
+			line = line * 10 + (ed->goto_line[i] - '0');
+		}
+		file_buffer_goto_line(&ed->file_buffer, &ed->file_buffer_bounds, line > 0 ? line - 1 : 0);
+		break;
+	}
+	case '\e':
+		ed->state.mode = EDITOR_MODE_NORMAL;
+		editor_set_message(ed, "");
+		break;
+	case 127:
+		if (ed->goto_line_len == 0) {
+			ed->state.mode = EDITOR_MODE_NORMAL;
+			editor_set_message(ed, "");
+			break;
+		}
+		ed->goto_line_len--;
+		editor_goto_show(ed);
+		break;
+	default:
+		editor_goto_append(ed, c);
+		break;
+	}
+}
+
+// Insert text typed or pasted into the file. If more input may follow, any
+// incomplete character at the end is left for next time. Returns the number of
+// bytes used.
+static int editor_insert_text(struct editor *ed, const char *str, int len, bool more)
+{
+	if (ed->state.mode == EDITOR_MODE_SEARCH) {
+		// Pasting while searching adds to the query instead.
+		for (int i = 0; i < len; i++) {
+			editor_search_append(ed, str[i]);
+		}
+		return len;
+	}
+	if (ed->state.mode == EDITOR_MODE_REGEX) {
+		for (int i = 0; i < len; i++) {
+			editor_regex_append(ed, str[i]);
+		}
+		return len;
+	}
+	if (ed->state.mode == EDITOR_MODE_GOTO) {
+		for (int i = 0; i < len; i++) {
+			editor_goto_append(ed, str[i]);
+		}
+		return len;
+	}
+	if (ed->state.mode == EDITOR_MODE_GREP) {
+		// The project search results take no text, and the file behind them
+		// isn't showing, so a paste is dropped.
+		return len;
+	}
+	if (more) {
+		len -= incomplete_char_len(str, len);
+	}
+	if (len > 0) {
+		file_buffer_insert(&ed->file_buffer, str, len);
+		file_buffer_update_cursor_coords(&ed->file_buffer, &ed->file_buffer_bounds);
+		ed->dirty = true;
+	}
+	return len;
+}
+
+// Handle everything in ed->input. Runs of typed text and whole pastes are each
+// inserted in one go. Nothing is drawn - see editor_present. Returns true if the
+// editor should exit.
+bool editor_handle_input(struct editor *ed)
+{
+	char *buf	  = ed->input;
+	int   len	  = ed->input_len;
+	int   i		  = 0;
+	bool  should_exit = false;
+
+	while (i < len && !should_exit) {
+		if (ed->pasting) {
+			// Everything up to the end marker is text, whichever mode we're in.
+			int end = i;
+			while (end < len && (len - end < TERMINAL_PASTE_MARKER_LEN ||
+					     memcmp(&buf[end], TERMINAL_PASTE_END, TERMINAL_PASTE_MARKER_LEN) != 0)) {
+				end++;
+			}
+			if (end < len) {
+				editor_insert_text(ed, &buf[i], end - i, false);
+				i	    = end + TERMINAL_PASTE_MARKER_LEN;
+				ed->pasting = false;
+				undo_history_break(&ed->file_buffer.history);
+				continue;
+			}
+
+			// The end marker may be cut off at the end of the input.
+			int held = ends_with_prefix(&buf[i], len - i, TERMINAL_PASTE_END);
+			i += editor_insert_text(ed, &buf[i], len - i - held, true);
+			break;
+		}
+
+		if (buf[i] == '\e') {
+			int rest = len - i;
+			if (rest >= TERMINAL_PASTE_MARKER_LEN &&
+			    memcmp(&buf[i], TERMINAL_PASTE_START, TERMINAL_PASTE_MARKER_LEN) == 0) {
+				// A paste is undone on its own.
+				ed->pasting = true;
+				undo_history_break(&ed->file_buffer.history);
+				i += TERMINAL_PASTE_MARKER_LEN;
+				continue;
+			}
+			// Wait for the rest of a start marker, but not after a lone escape.
+			if (rest > 1 && rest < TERMINAL_PASTE_MARKER_LEN && memcmp(&buf[i], TERMINAL_PASTE_START, rest) == 0) {
 				break;
 			}
+		}
+
+		if (ed->state.mode == EDITOR_MODE_INSERT) {
+			int end = i;
+			while (end < len && buf[end] != '\e' && buf[end] != 127 && buf[end] != KEY_CTRL('s')) {
+				end++;
+			}
+			if (end > i) {
+				int used = editor_insert_text(ed, &buf[i], end - i, end == len);
+				if (used == 0) {
+					break;
+				}
+				i += used;
+				continue;
+			}
+		}
+
+		should_exit = editor_handle_key(ed, buf[i++]);
+	}
+
+	// Keep whatever is left over for the next read.
+	memmove(buf, &buf[i], len - i);
+	ed->input_len = len - i;
+
+	return should_exit;
+}
+
+void editor_cleanup(struct editor *ed)
+{
+	re_free(ed->regex.re);
+	grep_cleanup(&ed->grep);
+	file_save_cleanup(&ed->save);
+	file_buffer_cleanup(&ed->file_buffer);
+	render_context_cleanup(&ed->render_ctx);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Get the length of the next thing a terminal would send in one go: a whole
+// bracketed paste, or otherwise a single key.
+static ssize_t replay_event_len(const char *keys, ssize_t len)
+{
+	if (len < TERMINAL_PASTE_MARKER_LEN || memcmp(keys, TERMINAL_PASTE_START, TERMINAL_PASTE_MARKER_LEN) != 0) {
+		return 1;
+	}
+	for (ssize_t i = TERMINAL_PASTE_MARKER_LEN; i + TERMINAL_PASTE_MARKER_LEN <= len; i++) {
+		if (memcmp(&keys[i], TERMINAL_PASTE_END, TERMINAL_PASTE_MARKER_LEN) == 0) {
+			return i + TERMINAL_PASTE_MARKER_LEN;
+		}
+	}
+	return len;
+}
+
+// Run the editor on pathname without a terminal: feed it the keys recorded in
+// trace_path (as written by te -w), send its output to /dev/null, and print how
+// long each key took to handle and render as tab separated percentiles, along
+// with how many frames were drawn and how many bytes they took.
+int replay(char *trace_path, char *pathname, int rows, int cols)
+{
+	int trace_fd = open(trace_path, O_RDONLY);
+	if (trace_fd == -1) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(trace_fd, &st) == -1) {
+		close(trace_fd);
+		return -1;
+	}
+
+	char	 *keys	  = malloc(st.st_size + 1);
+	uint64_t *latency = malloc((st.st_size + 1) * sizeof(uint64_t));
+	if (keys == NULL || latency == NULL) {
+		free(keys);
+		free(latency);
+		close(trace_fd);
+		return -1;
+	}
+
+	ssize_t num_keys = 0;
+	while (num_keys < st.st_size) {
+		ssize_t n = read(trace_fd, keys + num_keys, st.st_size - num_keys);
+		if (n == -1) {
+			free(keys);
+			free(latency);
+			close(trace_fd);
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		num_keys += n;
+	}
+	close(trace_fd);
+
+	struct editor ed    = {};
+	ed.term.window_rows = rows;
+	ed.term.window_cols = cols;
+	ed.term.fd	    = open("/dev/null", O_WRONLY);
+	if (ed.term.fd == -1 || editor_init(&ed, pathname) == -1) {
+		free(keys);
+		free(latency);
+		return -1;
+	}
+
+	editor_render(&ed);
+
+	ssize_t	 num_handled = 0;
+	ssize_t	 num_events  = 0;
+	ssize_t	 num_frames  = 0;
+	uint64_t frame_bytes = 0;
+	bool	 should_exit = false;
+	while (num_handled < num_keys && !should_exit) {
+		// Each key arrives by itself, except for pastes which arrive all at once.
+		ssize_t event_len = replay_event_len(&keys[num_handled], num_keys - num_handled);
+
+		uint64_t start = now_ns();
+		for (ssize_t i = 0; i < event_len && !should_exit;) {
+			int n = MIN(event_len - i, (ssize_t)sizeof(ed.input) - ed.input_len);
+			memcpy(&ed.input[ed.input_len], &keys[num_handled + i], n);
+			ed.input_len += n;
+			i += n;
+			should_exit = editor_handle_input(&ed);
+		}
+		if (editor_frame_pending(&ed)) {
+			bool redraw = ed.dirty;
+			editor_present(&ed);
+			if (redraw) {
+				num_frames++;
+				frame_bytes += ed.render_ctx.frame_bytes;
+			}
+		}
+		latency[num_events++] = now_ns() - start;
+		num_handled += event_len;
+	}
+
+	editor_cleanup(&ed);
+	close(ed.term.fd);
+
+	printf("keys\t%zd\n", num_events);
+	printf("frames\t%zd\n", num_frames);
+	printf("frame_bytes\t%llu\n", (unsigned long long)frame_bytes);
+	if (num_events > 0) {
+		qsort(latency, num_events, sizeof(uint64_t), compare_u64);
+		int percentiles[] = {50, 90, 99, 100};
+		for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+			printf("p%d_ns\t%llu\n", percentiles[i],
+			       (unsigned long long)latency[(num_events - 1) * percentiles[i] / 100]);
+		}
+	}
+
+	free(keys);
+	free(latency);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: te [-w trace] [file]\n"
+			"       te -r trace [-s rowsxcols] [file]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	int   rows	  = 24;
+	int   cols	  = 80;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:r:s:")) != -1) {
+		switch (opt) {
+		case 'w':
+			record_path = optarg;
+			break;
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &rows, &cols) != 2 || rows < 3 || cols < 1) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind > 1) {
+		usage();
+	}
+
+	// Traces are recorded against dummyfile.txt unless another file is given.
+	char *pathname = optind < argc ? argv[optind] : "dummyfile.txt";
+
+	if (replay_path != NULL) {
+		if (replay(replay_path, pathname, rows, cols) == -1) {
+			err(EXIT_FAILURE, "replay");
+		}
+		return EXIT_SUCCESS;
+	}
+
+	int record_fd = -1;
+	if (record_path != NULL) {
+		record_fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (record_fd == -1) {
+			err(EXIT_FAILURE, "open %s", record_path);
+		}
+	}
+
+	struct editor ed = {};
+
+	if (terminal_init(&ed.term) == -1) {
+		err(EXIT_FAILURE, "terminal init");
+	}
+
+	if (editor_init(&ed, pathname) == -1) {
+		terminal_cleanup(&ed.term);
+		err(EXIT_FAILURE, "%s", pathname);
+	}
+
+	editor_render(&ed);
+
+	for (;;) {
+		// A frame is drawn once all the input which has arrived is handled, so
+		// a burst of keys is shown in one frame rather than queueing up stale
+		// ones. A key after a quiet spell is shown straight away, but otherwise
+		// frames are spaced out by EDITOR_FRAME_INTERVAL, and keys which arrive
+		// in the meantime go into the same frame. If input or search hits keep
+		// arriving, poll never times out, so a frame which is due is also drawn
+		// after handling them.
+		int timeout = -1;
+		if (editor_frame_pending(&ed)) {
+			uint64_t since = now_ns() - ed.last_frame;
+			timeout	       = since >= EDITOR_FRAME_INTERVAL ? 0 : (EDITOR_FRAME_INTERVAL - since + 999999) / 1000000;
+		}
+
+		// Also wait for a background save to finish, and for project search
+		// hits to come in, if they're running. poll skips negative fds.
+		struct pollfd pfds[3] = {
+			{.fd = ed.term.fd, .events = POLLIN},
+			{.fd = ed.save.running ? ed.save.done_pipe[0] : -1, .events = POLLIN},
+			{.fd = ed.grep.running ? ed.grep.notify_pipe[0] : -1, .events = POLLIN},
+		};
+		int ready = poll(pfds, 3, timeout);
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll input");
+		}
+		if (ready == 0) {
+			editor_present(&ed);
+			continue;
+		}
+		if (ed.save.running && (pfds[1].revents & POLLIN)) {
+			editor_save_done(&ed);
+		}
+		if (ed.grep.running && (pfds[2].revents & POLLIN)) {
+			editor_grep_update(&ed);
+		}
+		if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			editor_present_if_due(&ed);
+			continue;
+		}
 
-			file_buffer_reload_str(&file_buffer);
-			file_buffer_update_cursor_coords(&file_buffer, &file_buffer_bounds);
+		// Read everything that's available, so that a burst of input (such as
+		// a paste) is handled in one go.
+		char   *input = &ed.input[ed.input_len];
+		ssize_t n     = read(ed.term.fd, input, sizeof(ed.input) - ed.input_len);
+		if (n == -1) {
+			err(EXIT_FAILURE, "read input");
+		}
+		if (n == 0) {
+			// The terminal has hung up, and poll would keep saying so.
+			break;
+		}
 
-			render_context_clear(&render_ctx);
-			file_buffer_render_to_context(&file_buffer, &render_ctx, &file_buffer_bounds);
-			status_line_render_to_context(&status_line, &render_ctx, &status_line_bounds);
-			render_context_render(&render_ctx, term.fd, file_buffer.cursor_row, file_buffer.cursor_col);
+		// Keys are recorded as they are read, so that replaying them takes the
+		// same path through editor_handle_input.
+		if (record_fd != -1 && write(record_fd, input, n) == -1) {
+			err(EXIT_FAILURE, "record input");
 		}
 
-		if (should_exit) {
+		ed.input_len += n;
+		if (editor_handle_input(&ed)) {
 			break;
 		}
+		editor_present_if_due(&ed);
+	}
+
+	if (record_fd != -1) {
+		close(record_fd);
 	}
 
-	render_context_cleanup(&render_ctx);
-	terminal_cleanup(&term);
+	editor_cleanup(&ed);
+	terminal_cleanup(&ed.term);
 }
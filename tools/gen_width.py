@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Generate width.h, the number of columns each codepoint takes up on a
+# terminal, from the Unicode database which comes with Python:
+#
+#   python3 tools/gen_width.py > width.h
+#
+# Wide and fullwidth characters take up 2 columns, combining marks, format
+# characters and Hangul medial vowels and final consonants 0, and everything
+# else 1. Unassigned codepoints in the CJK blocks are wide, as
+# EastAsianWidth.txt says they should be treated.
+
+import unicodedata
+
+BLOCK_SIZE = 256
+NUM_CODEPOINTS = 0x110000
+
+WIDE_UNASSIGNED = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF), (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+
+
+def width(c):
+    ch = chr(c)
+    category = unicodedata.category(ch)
+    if c == 0xAD:
+        return 1  # The soft hyphen is drawn as a hyphen.
+    if category in ("Mn", "Me", "Cf") or 0x1160 <= c <= 0x11FF:
+        return 0
+    if unicodedata.east_asian_width(ch) in ("W", "F"):
+        return 2
+    if category == "Cn" and any(lo <= c <= hi for lo, hi in WIDE_UNASSIGNED):
+        return 2
+    return 1
+
+
+def pack(widths):
+    # Four widths to a byte, the first in the low bits.
+    return bytes(sum(w << (2 * j) for j, w in enumerate(widths[i : i + 4])) for i in range(0, len(widths), 4))
+
+
+blocks = []
+block_ids = {}
+index = []
+for start in range(0, NUM_CODEPOINTS, BLOCK_SIZE):
+    block = pack([width(c) for c in range(start, start + BLOCK_SIZE)])
+    if block not in block_ids:
+        block_ids[block] = len(blocks)
+        blocks.append(block)
+    index.append(block_ids[block])
+assert len(blocks) <= 256
+
+
+def rows(values, per_row):
+    for i in range(0, len(values), per_row):
+        yield "\t" + " ".join("0x%02x," % v for v in values[i : i + per_row])
+
+
+print(
+    """/* The number of columns each codepoint takes up on a terminal.
+ *
+ * Generated by tools/gen_width.py from Unicode %s - don't edit this file.
+ *
+ * The widths are looked up in two levels: blocks of %d codepoints with the
+ * same widths share a row of width_blocks, which holds 2 bits per codepoint,
+ * and width_index says which row each block uses.
+ */
+
+#ifndef width_h
+#define width_h
+
+#include <stdint.h>
+
+static const uint8_t width_index[%d] = {"""
+    % (unicodedata.unidata_version, BLOCK_SIZE, len(index))
+)
+for row in rows(index, 16):
+    print(row)
+print("};\n")
+print("static const uint8_t width_blocks[%d][%d] = {" % (len(blocks), BLOCK_SIZE // 4))
+for block in blocks:
+    print("\t{")
+    for row in rows(block, 16):
+        print("\t" + row)
+    print("\t},")
+print(
+    """};
+
+// Get the number of columns codepoint c takes up: 0, 1 or 2. Control
+// characters aren't drawn as themselves, so what they get here doesn't mean
+// anything.
+static inline int width_codepoint(uint32_t c)
+{
+	if (c >= 0x%x) {
+		return 1;
+	}
+	return (width_blocks[width_index[c / %d]][c %% %d / 4] >> (c %% 4 * 2)) & 3;
+}
+
+#endif"""
+    % (NUM_CODEPOINTS, BLOCK_SIZE, BLOCK_SIZE)
+)
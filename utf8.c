@@ -0,0 +1,377 @@
+#include "utf8.h"
+#include <string.h>
+
+#if UTF8_SIMD && defined(__x86_64__)
+#define UTF8_X86 1
+#include <immintrin.h>
+#else
+#define UTF8_X86 0
+#endif
+
+// Strings shorter than this aren't worth setting up the vector code for.
+#define UTF8_MIN_SIMD_BYTES 32
+
+static bool check_and_count_scalar(const uint8_t *str, size_t num_bytes, size_t *num_chars, size_t *num_wchars)
+{
+	const uint8_t *p      = str;
+	const uint8_t *end    = str + num_bytes;
+	size_t	       chars  = 0;
+	size_t	       wchars = 0;
+	while (p < end) {
+		size_t size = utf8_codepoint_size(*p);
+		if (size == SIZE_MAX || size > (size_t)(end - p)) {
+			return false;
+		}
+		for (size_t i = 1; i < size; i++) {
+			// Check that any middle bytes are of the form 0x10xx xxxx
+			if ((p[i] & 0xc0) != 0x80) {
+				return false;
+			}
+		}
+		// Characters outside the BMP take a surrogate pair.
+		wchars += 1 + (*p >= 0xf0);
+		p += size;
+		chars++;
+	}
+
+	*num_chars  = chars;
+	*num_wchars = wchars;
+	return true;
+}
+
+static size_t count_chars_scalar(const uint8_t *str, size_t num_bytes)
+{
+	size_t chars = 0;
+	for (size_t i = 0; i < num_bytes; i++) {
+		// Count everything except continuation bytes (10xx xxxx).
+		chars += (str[i] & 0xc0) != 0x80;
+	}
+	return chars;
+}
+
+static size_t count_bytes_scalar(const uint8_t *str, size_t num_chars)
+{
+	const uint8_t *p = str;
+	for (size_t i = 0; i < num_chars; i++) {
+		p += utf8_codepoint_size(*p);
+	}
+	return p - str;
+}
+
+#if UTF8_X86
+
+// Bit masks describing a 64 byte block of text, where bit i stands for byte i.
+// Only bad is filled in for blocks which are entirely ASCII.
+typedef struct {
+	uint64_t high;	// Bytes >= 0x80
+	uint64_t ge_c0; // Lead bytes of characters 2 or more bytes long
+	uint64_t ge_e0; // ... 3 or more bytes long
+	uint64_t ge_f0; // ... 4 or more bytes long
+	uint64_t ge_f8; // ... 5 or more bytes long
+	uint64_t ge_fc; // ... 6 bytes long
+	bool	 bad;	// Whether the block has any 0x00, 0xfe or 0xff bytes
+} block_masks;
+
+// Fills in m for the 64 bytes at p, and returns true if they are all ASCII.
+typedef bool (*classify_fn)(const uint8_t *p, block_masks *m);
+
+// Get a mask of the bytes in the 64 bytes at p which aren't continuation bytes.
+typedef uint64_t (*leads_fn)(const uint8_t *p);
+
+// A string is valid if each byte is a continuation byte exactly when a lead
+// byte in the 5 bytes before it says it should be. carry holds the continuation
+// bytes the end of the previous block expects at the start of this one.
+static inline __attribute__((always_inline)) bool check_block(const block_masks *m, bool ascii, uint64_t *carry,
+							      size_t *chars, size_t *extra_wchars)
+{
+	if (ascii) {
+		*chars += 64;
+		return *carry == 0 && !m->bad;
+	}
+
+	uint64_t cont	  = m->high & ~m->ge_c0;
+	uint64_t expected = *carry | m->ge_c0 << 1 | m->ge_e0 << 2 | m->ge_f0 << 3 | m->ge_f8 << 4 | m->ge_fc << 5;
+	if (expected != cont || m->bad) {
+		return false;
+	}
+
+	*carry = m->ge_c0 >> 63 | m->ge_e0 >> 62 | m->ge_f0 >> 61 | m->ge_f8 >> 60 | m->ge_fc >> 59;
+	*chars += 64 - __builtin_popcountll(cont);
+	*extra_wchars += __builtin_popcountll(m->ge_f0);
+	return true;
+}
+
+static inline __attribute__((always_inline)) bool check_and_count_blocks(const uint8_t *str, size_t num_bytes,
+									  size_t *num_chars, size_t *num_wchars,
+									  classify_fn classify)
+{
+	block_masks m;
+	uint64_t    carry	 = 0;
+	size_t	    chars	 = 0;
+	size_t	    extra_wchars = 0;
+
+	size_t i = 0;
+	for (; i + 64 <= num_bytes; i += 64) {
+		bool ascii = classify(&str[i], &m);
+		if (!check_block(&m, ascii, &carry, &chars, &extra_wchars)) {
+			return false;
+		}
+	}
+
+	if (i < num_bytes) {
+		// Pad the end out with spaces. A character cut short by the end of the
+		// string expects continuation bytes there, so it is still caught.
+		uint8_t tail[64];
+		memset(tail, ' ', sizeof(tail));
+		memcpy(tail, &str[i], num_bytes - i);
+		bool ascii = classify(tail, &m);
+		if (!check_block(&m, ascii, &carry, &chars, &extra_wchars)) {
+			return false;
+		}
+		chars -= sizeof(tail) - (num_bytes - i);
+	}
+
+	if (carry) {
+		return false;
+	}
+
+	*num_chars  = chars;
+	*num_wchars = chars + extra_wchars;
+	return true;
+}
+
+static inline __attribute__((always_inline)) size_t count_chars_blocks(const uint8_t *str, size_t num_bytes,
+									leads_fn leads)
+{
+	size_t chars = 0;
+	size_t i     = 0;
+	for (; i + 64 <= num_bytes; i += 64) {
+		chars += __builtin_popcountll(leads(&str[i]));
+	}
+
+	if (i < num_bytes) {
+		// Pad the end out with continuation bytes, which aren't counted.
+		uint8_t tail[64];
+		memset(tail, 0x80, sizeof(tail));
+		memcpy(tail, &str[i], num_bytes - i);
+		chars += __builtin_popcountll(leads(tail));
+	}
+	return chars;
+}
+
+static inline __attribute__((always_inline)) size_t count_bytes_blocks(const uint8_t *str, size_t num_chars,
+									leads_fn leads)
+{
+	// While there are more characters left than a block can hold, the whole
+	// block is part of the range (and safe to read).
+	const uint8_t *p = str;
+	while (num_chars > 64) {
+		num_chars -= __builtin_popcountll(leads(p));
+		p += 64;
+	}
+
+	// p may be part way through a character whose lead byte was counted above.
+	if (p != str) {
+		while ((*p & 0xc0) == 0x80) {
+			p++;
+		}
+	}
+	return (p - str) + count_bytes_scalar(p, num_chars);
+}
+
+#ifndef __AVX2__
+static inline uint64_t ge_sse2(const __m128i v[4], uint8_t c)
+{
+	__m128i	 min  = _mm_set1_epi8((char)c);
+	uint64_t mask = 0;
+	for (int i = 0; i < 4; i++) {
+		uint64_t bits = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v[i], min), v[i]));
+		mask |= bits << (16 * i);
+	}
+	return mask;
+}
+
+static inline bool classify_sse2(const uint8_t *p, block_masks *m)
+{
+	__m128i v[4];
+	for (int i = 0; i < 4; i++) {
+		v[i] = _mm_loadu_si128((const __m128i *)&p[16 * i]);
+	}
+
+	__m128i min	 = _mm_min_epu8(_mm_min_epu8(v[0], v[1]), _mm_min_epu8(v[2], v[3]));
+	__m128i max	 = _mm_max_epu8(_mm_max_epu8(v[0], v[1]), _mm_max_epu8(v[2], v[3]));
+	bool	has_zero = _mm_movemask_epi8(_mm_cmpeq_epi8(min, _mm_setzero_si128())) != 0;
+	if (_mm_movemask_epi8(max) == 0) {
+		m->bad = has_zero;
+		return true;
+	}
+
+	__m128i fe = _mm_set1_epi8((char)0xfe);
+	m->bad	   = has_zero || _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(max, fe), max)) != 0;
+	m->high	   = 0;
+	for (int i = 0; i < 4; i++) {
+		m->high |= (uint64_t)(uint16_t)_mm_movemask_epi8(v[i]) << (16 * i);
+	}
+	m->ge_c0 = ge_sse2(v, 0xc0);
+	m->ge_e0 = ge_sse2(v, 0xe0);
+	m->ge_f0 = ge_sse2(v, 0xf0);
+	m->ge_f8 = ge_sse2(v, 0xf8);
+	m->ge_fc = ge_sse2(v, 0xfc);
+	return false;
+}
+
+static inline uint64_t leads_sse2(const uint8_t *p)
+{
+	// Continuation bytes are 0x80 - 0xbf, which are the signed bytes <= -65.
+	__m128i	 cont_max = _mm_set1_epi8((char)0xbf);
+	uint64_t mask	  = 0;
+	for (int i = 0; i < 4; i++) {
+		__m128i	 v    = _mm_loadu_si128((const __m128i *)&p[16 * i]);
+		uint64_t bits = (uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, cont_max));
+		mask |= bits << (16 * i);
+	}
+	return mask;
+}
+
+static bool check_and_count_sse2(const uint8_t *str, size_t num_bytes, size_t *num_chars, size_t *num_wchars)
+{
+	return check_and_count_blocks(str, num_bytes, num_chars, num_wchars, classify_sse2);
+}
+
+static size_t count_chars_sse2(const uint8_t *str, size_t num_bytes)
+{
+	return count_chars_blocks(str, num_bytes, leads_sse2);
+}
+
+static size_t count_bytes_sse2(const uint8_t *str, size_t num_chars)
+{
+	return count_bytes_blocks(str, num_chars, leads_sse2);
+}
+#endif
+
+#define AVX2 __attribute__((target("avx2,popcnt")))
+
+AVX2 static inline uint64_t ge_avx2(__m256i lo, __m256i hi, uint8_t c)
+{
+	__m256i	 min = _mm256_set1_epi8((char)c);
+	uint64_t l   = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(lo, min), lo));
+	uint64_t h   = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(hi, min), hi));
+	return l | h << 32;
+}
+
+AVX2 static inline bool classify_avx2(const uint8_t *p, block_masks *m)
+{
+	__m256i lo = _mm256_loadu_si256((const __m256i *)p);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)&p[32]);
+
+	__m256i min	 = _mm256_min_epu8(lo, hi);
+	__m256i max	 = _mm256_max_epu8(lo, hi);
+	bool	has_zero = _mm256_movemask_epi8(_mm256_cmpeq_epi8(min, _mm256_setzero_si256())) != 0;
+	if (_mm256_movemask_epi8(max) == 0) {
+		m->bad = has_zero;
+		return true;
+	}
+
+	__m256i fe = _mm256_set1_epi8((char)0xfe);
+	m->bad	   = has_zero || _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(max, fe), max)) != 0;
+	m->high	   = (uint32_t)_mm256_movemask_epi8(lo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+	m->ge_c0   = ge_avx2(lo, hi, 0xc0);
+	m->ge_e0   = ge_avx2(lo, hi, 0xe0);
+	m->ge_f0   = ge_avx2(lo, hi, 0xf0);
+	m->ge_f8   = ge_avx2(lo, hi, 0xf8);
+	m->ge_fc   = ge_avx2(lo, hi, 0xfc);
+	return false;
+}
+
+AVX2 static inline uint64_t leads_avx2(const uint8_t *p)
+{
+	__m256i	 cont_max = _mm256_set1_epi8((char)0xbf);
+	__m256i	 lo	  = _mm256_loadu_si256((const __m256i *)p);
+	__m256i	 hi	  = _mm256_loadu_si256((const __m256i *)&p[32]);
+	uint64_t l	  = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(lo, cont_max));
+	uint64_t h	  = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(hi, cont_max));
+	return l | h << 32;
+}
+
+AVX2 static bool check_and_count_avx2(const uint8_t *str, size_t num_bytes, size_t *num_chars, size_t *num_wchars)
+{
+	return check_and_count_blocks(str, num_bytes, num_chars, num_wchars, classify_avx2);
+}
+
+AVX2 static size_t count_chars_avx2(const uint8_t *str, size_t num_bytes)
+{
+	return count_chars_blocks(str, num_bytes, leads_avx2);
+}
+
+AVX2 static size_t count_bytes_avx2(const uint8_t *str, size_t num_chars)
+{
+	return count_bytes_blocks(str, num_chars, leads_avx2);
+}
+
+// Call the AVX2 version of a function if the CPU has it, or the SSE2 version
+// (which every x86-64 CPU has) otherwise. Builds which target AVX2 already,
+// eg. with -march=native on a recent machine, skip the check.
+#ifdef __AVX2__
+#define DISPATCH(name, ...) name##_avx2(__VA_ARGS__)
+#else
+#define DISPATCH(name, ...) (__builtin_cpu_supports("avx2") ? name##_avx2(__VA_ARGS__) : name##_sse2(__VA_ARGS__))
+#endif
+
+#endif
+
+bool utf8_check_and_count(const uint8_t *str, size_t num_bytes, size_t *num_chars, size_t *num_wchars)
+{
+#if UTF8_X86
+	if (num_bytes >= UTF8_MIN_SIMD_BYTES) {
+		return DISPATCH(check_and_count, str, num_bytes, num_chars, num_wchars);
+	}
+#endif
+	return check_and_count_scalar(str, num_bytes, num_chars, num_wchars);
+}
+
+size_t utf8_count_chars(const uint8_t *str, size_t num_bytes)
+{
+#if UTF8_X86
+	if (num_bytes >= UTF8_MIN_SIMD_BYTES) {
+		return DISPATCH(count_chars, str, num_bytes);
+	}
+#endif
+	return count_chars_scalar(str, num_bytes);
+}
+
+size_t utf8_count_bytes(const uint8_t *str, size_t num_chars)
+{
+#if UTF8_X86
+	if (num_chars > 64) {
+		return DISPATCH(count_bytes, str, num_chars);
+	}
+#endif
+	return count_bytes_scalar(str, num_chars);
+}
+
+// Runs of printable characters are looked for a screen row at a time, which is
+// too short for the AVX2 check to pay off, so this sticks to SSE2.
+size_t utf8_count_printable(const uint8_t *str, size_t num_bytes)
+{
+	size_t i = 0;
+#if UTF8_X86
+	if (num_bytes == 0 || str[0] < ' ' || str[0] > '~') {
+		return 0;
+	}
+
+	// Printable characters are the signed bytes between 0x1f and 0x7f.
+	__m128i below = _mm_set1_epi8(0x1f);
+	__m128i above = _mm_set1_epi8(0x7f);
+	for (; i + 16 <= num_bytes; i += 16) {
+		__m128i	 v    = _mm_loadu_si128((const __m128i *)&str[i]);
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, below), _mm_cmplt_epi8(v, above)));
+		if (mask != 0xffff) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+#endif
+	while (i < num_bytes && str[i] >= ' ' && str[i] <= '~') {
+		i++;
+	}
+	return i;
+}
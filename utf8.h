@@ -0,0 +1,114 @@
+/* UTF-8 scanning routines.
+ *
+ * These are the loops the rope runs over its text on every insert, delete and
+ * seek. On x86-64 they work on 64 bytes at a time using SSE2, or AVX2 when the
+ * CPU supports it, with a fast path for runs of ASCII. Everywhere else (or when
+ * built with UTF8_SIMD=0) they fall back to plain byte loops.
+ *
+ * A string is valid utf8 here if every character is a lead byte followed by as
+ * many continuation bytes (10xx xxxx) as the lead byte asks for, and it contains
+ * no NUL bytes. As in the rope, 5 and 6 byte sequences are allowed and overlong
+ * encodings aren't checked for.
+ */
+
+#ifndef utf8_h
+#define utf8_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#ifndef UTF8_SIMD
+#define UTF8_SIMD 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Find out how many bytes the character which starts with the specified byte
+// will occupy in memory. Returns SIZE_MAX if the byte can't start a character.
+static inline size_t utf8_codepoint_size(uint8_t byte)
+{
+	if (byte == 0) {
+		return SIZE_MAX;
+	} // NULL byte.
+	else if (byte <= 0x7f) {
+		return 1;
+	} // 0x74 = 0111 1111
+	else if (byte <= 0xbf) {
+		return SIZE_MAX;
+	} // 1011 1111. Invalid for a starting byte.
+	else if (byte <= 0xdf) {
+		return 2;
+	} // 1101 1111
+	else if (byte <= 0xef) {
+		return 3;
+	} // 1110 1111
+	else if (byte <= 0xf7) {
+		return 4;
+	} // 1111 0111
+	else if (byte <= 0xfb) {
+		return 5;
+	} // 1111 1011
+	else if (byte <= 0xfd) {
+		return 6;
+	} // 1111 1101
+	else {
+		return SIZE_MAX;
+	}
+}
+
+// Get the codepoint of the size byte character at str, which must be valid.
+static inline uint32_t utf8_decode(const uint8_t *str, size_t size)
+{
+	static const uint8_t lead_bits[] = {0, 0x7f, 0x1f, 0x0f, 0x07, 0x03, 0x01};
+
+	uint32_t c = str[0] & lead_bits[size];
+	for (size_t i = 1; i < size; i++) {
+		c = c << 6 | (str[i] & 0x3f);
+	}
+	return c;
+}
+
+// Write codepoint c to out as utf8, which takes up to 6 bytes. Returns the
+// number of bytes written.
+static inline size_t utf8_encode(uint32_t c, uint8_t *out)
+{
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	}
+	size_t size = c < 0x800 ? 2 : c < 0x10000 ? 3 : c < 0x200000 ? 4 : c < 0x4000000 ? 5 : 6;
+	for (size_t i = size - 1; i > 0; i--) {
+		out[i] = 0x80 | (c & 0x3f);
+		c >>= 6;
+	}
+	out[0] = (uint8_t)(0xff00 >> size) | c;
+	return size;
+}
+
+// Check that the num_bytes bytes at str are valid utf8, counting the characters
+// in them on the way. *num_wchars is set to the number of UTF-16 code units the
+// characters would take up. Returns false if the string is invalid or ends part
+// way through a character.
+bool utf8_check_and_count(const uint8_t *str, size_t num_bytes, size_t *num_chars, size_t *num_wchars);
+
+// Count the characters in the first num_bytes bytes of valid utf8.
+size_t utf8_count_chars(const uint8_t *str, size_t num_bytes);
+
+// Count how many bytes the first num_chars characters of valid utf8 take up.
+size_t utf8_count_bytes(const uint8_t *str, size_t num_chars);
+
+// Count the printable ASCII characters (' ' to '~') at the start of the
+// num_bytes bytes at str.
+size_t utf8_count_printable(const uint8_t *str, size_t num_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif